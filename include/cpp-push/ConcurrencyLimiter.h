@@ -0,0 +1,142 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+
+#include <boost/asio.hpp>
+
+#include "cpp-push/Pusher.h"
+
+namespace jgaa::cpp_push {
+
+/*! Adaptive limit for the number of requests in flight.
+ *
+ * Uses additive increase / multiplicative decrease (AIMD). The limit grows by one
+ * when a full window of requests succeeded without the round-trip time drifting
+ * too far above the lowest observed round-trip time, and shrinks when the latency
+ * rises or the server signals overload (HTTP 429, 5xx or transport errors).
+ *
+ * Callers that exceed the limit are suspended in `acquire()` and resumed in FIFO order.
+ * After `close()`, `acquire()` returns an empty permit.
+ */
+class ConcurrencyLimiter {
+public:
+    using clock_t = std::chrono::steady_clock;
+
+    enum class Outcome {
+        OK,         // The request succeeded. Its RTT is used to adjust the limit
+        OVERLOAD,   // The server was overloaded or unreachable. Back off
+        FAILED      // The request failed for other reasons. Does not affect the limit
+    };
+
+    struct Stats {
+        unsigned limit{};
+        unsigned in_flight{};
+        size_t waiting{};
+        std::chrono::microseconds min_rtt{};
+        std::chrono::microseconds smoothed_rtt{};
+        uint64_t num_ok{};
+        uint64_t num_overload{};
+        uint64_t num_failed{};
+    };
+
+    /*! A slot for one request.
+     *
+     * Call `done()` when the request completes. If the permit is destroyed
+     * without `done()` being called, it is released as FAILED.
+     */
+    class Permit {
+    public:
+        Permit() = default;
+        Permit(const Permit&) = delete;
+        Permit(Permit&& v) noexcept
+            : limiter_{std::exchange(v.limiter_, nullptr)}, started_{v.started_} {}
+
+        Permit& operator = (const Permit&) = delete;
+        Permit& operator = (Permit&& v) noexcept {
+            if (this != &v) {
+                done(Outcome::FAILED);
+                limiter_ = std::exchange(v.limiter_, nullptr);
+                started_ = v.started_;
+            }
+            return *this;
+        }
+
+        ~Permit() {
+            done(Outcome::FAILED);
+        }
+
+        /*! False if the limiter was closed before the request was allowed to start */
+        explicit operator bool() const noexcept {
+            return limiter_ != nullptr;
+        }
+
+        void done(Outcome outcome) noexcept {
+            if (auto *limiter = std::exchange(limiter_, nullptr)) {
+                limiter->release(clock_t::now() - started_, outcome);
+            }
+        }
+
+    private:
+        friend class ConcurrencyLimiter;
+        explicit Permit(ConcurrencyLimiter *limiter)
+            : limiter_{limiter}, started_{clock_t::now()} {}
+
+        ConcurrencyLimiter *limiter_{};
+        clock_t::time_point started_;
+    };
+
+    explicit ConcurrencyLimiter(const Config::Concurrency& config);
+
+    /*! Wait until a request is allowed to start.
+     *
+     * @return A permit, or an empty permit if the limiter is closed.
+     */
+    [[nodiscard]] boost::asio::awaitable<Permit> acquire();
+
+    /*! Stop handing out permits, and resume all the waiters with an empty permit.
+     *
+     * Permits already handed out are not affected.
+     */
+    void close();
+
+    [[nodiscard]] Stats stats() const;
+
+    /*! Map a HTTP status code (0 for transport errors) to an outcome. */
+    [[nodiscard]] static Outcome classify(long http_status) noexcept;
+
+private:
+    struct Waiter {
+        explicit Waiter(boost::asio::any_io_executor ex)
+            : timer{std::move(ex), clock_t::time_point::max()} {}
+
+        boost::asio::steady_timer timer;
+        bool granted{false}; // Set before the timer is woken
+    };
+
+    void release(clock_t::duration rtt, Outcome outcome) noexcept;
+    void onSuccess(clock_t::duration rtt, clock_t::time_point now);
+    void backOff(clock_t::time_point now);
+    void grantLocked();
+
+    const Config::Concurrency config_;
+    mutable std::mutex mutex_;
+    double limit_;
+    unsigned in_flight_{};
+    unsigned ok_in_window_{};
+    bool closed_{false};
+    std::deque<std::shared_ptr<Waiter>> waiters_;
+    clock_t::duration min_rtt_{clock_t::duration::max()};
+    clock_t::duration window_min_rtt_{clock_t::duration::max()};
+    clock_t::duration smoothed_rtt_{};
+    clock_t::time_point window_started_{clock_t::now()};
+    clock_t::time_point last_backoff_{};
+    uint64_t num_ok_{};
+    uint64_t num_overload_{};
+    uint64_t num_failed_{};
+};
+
+} // ns
@@ -1,10 +1,18 @@
+#pragma once
 
 #include <atomic>
 #include <chrono>
+#include <functional>
+#include <mutex>
+#include <span>
+#include <vector>
 
 #include <restincurl/restincurl.h>
 
+#include "cpp-push/ConcurrencyLimiter.h"
 #include "cpp-push/Pusher.h"
+#include "cpp-push/Template.h"
+#include "cpp-push/Tracing.h"
 
 
 namespace jgaa::cpp_push {
@@ -19,6 +27,13 @@ public:
         STOPPED
     };
 
+    /*! Callback for state changes.
+     *
+     * Called from the thread that changed the state, normally the thread running
+     * the io_context. The callback must not block.
+     */
+    using state_listener_t = std::function<void(State state)>;
+
     struct OAuthToken {
         std::string access_token;
         std::chrono::system_clock::time_point expiry;
@@ -54,28 +69,82 @@ public:
         std::optional<GoogleNotification> notification; // Google specific notification
     };
 
+    /*! One recipient of a templated message */
+    struct Recipient {
+        std::string_view token;
+        std::string_view locale;    // Empty for the default locale of the catalog
+        Template::vars_t vars;      // Values for the placeholders in the templates
+    };
+
     /*! Constructor initializing the GooglePusher with the given configuration.
      * @param config The configuration for the GooglePusher.
+     * @param tracer Tracer to share with other instances. If empty, one is created from `config.tracing`.
      */
-    explicit GooglePusher(const Config& config, boost::asio::io_context& ctx);
+    explicit GooglePusher(const Config& config, boost::asio::io_context& ctx,
+                          std::shared_ptr<Tracer> tracer = {});
 
 
     virtual bool isReady() const noexcept override {
         return state_.load(std::memory_order_relaxed) == State::AVAILABLE;
     }
 
+    [[nodiscard]] virtual boost::asio::awaitable<bool> waitReady(std::chrono::steady_clock::duration timeout) override;
+
     [[nodiscard]] virtual boost::asio::awaitable<Result> push(const PushMessage& pm) override;
     [[nodiscard]] virtual boost::asio::awaitable<Result> gpush(const GooglePushMessage& pm);
 
+    /*! Send a message with a localized, personalized title and body to each recipient.
+     *
+     * The title and body are rendered from the templates for `template_id` in
+     * the recipient's locale, straight into the request. Everything else is taken
+     * from `pm`. `pm.to` is ignored.
+     *
+     * Oversized payloads are not compacted. The send stops at the first
+     * recipient that fails, like `gpush()`.
+     */
+    [[nodiscard]] virtual boost::asio::awaitable<Result> gpush(const GooglePushMessage& pm,
+                                                               const TemplateCatalog& catalog,
+                                                               std::string_view template_id,
+                                                               std::span<const Recipient> recipients);
+
     void run();
     void stop() override;
 
+    /*! Use the OAuth tokens and the availability of `leader` instead of running our own token refresh.
+     *
+     * Call this instead of `run()`. The leader must outlive this instance.
+     */
+    void follow(GooglePusher& leader);
+
     std::shared_ptr<OAuthToken> getAuth() const noexcept {
+        if (auth_source_) {
+            return auth_source_->getAuth();
+        }
         return auth_token_.load(std::memory_order_relaxed);
     }
 
+    /*! Convert a platform independent message to a Google message. */
+    [[nodiscard]] static GooglePushMessage toGooglePushMessage(const PushMessage& pm);
+
+    /*! Current state of the adaptive concurrency limit for requests to FCM. */
+    [[nodiscard]] ConcurrencyLimiter::Stats concurrency() const {
+        return limiter_.stats();
+    }
+
+    /*! Get notified when the state changes.
+     *
+     * @param listener Callback to call with the new state.
+     * @return An id that can be used to remove the listener.
+     */
+    size_t addStateListener(state_listener_t listener);
+
+    /*! Remove a listener added with `addStateListener()` */
+    void removeStateListener(size_t id);
+
 private:
     void setState(State state);
+    void setStateUnlessStopping(State state);
+    void onStateChanged(State old_state, State state);
     void setAuthToken(std::shared_ptr<OAuthToken> && token) {
         auth_token_.store(std::move(token), std::memory_order_relaxed);
     }
@@ -84,6 +153,35 @@ private:
         return state_.load(std::memory_order_relaxed);
     }
     boost::asio::awaitable<void> run_();
+
+    /*! Wait for the pushes in progress, up to the drain timeout, then cancel the rest and close the HTTP client.
+     *
+     * The state is set to STOPPED only when no push uses the instance anymore.
+     */
+    boost::asio::awaitable<void> drain();
+
+    /*! Wait on `timer` (the drain waiter) until no pushes are active, or until `deadline`.
+     * @return true if no pushes are active.
+     */
+    boost::asio::awaitable<bool> waitForPushes(boost::asio::steady_timer& timer,
+                                               boost::asio::steady_timer::time_point deadline);
+
+    /*! Counts a push as in progress for as long as it lives */
+    class ActivePush;
+
+    struct SendError {
+        Result::Error error{Result::Error::SEND_FAILED};
+        std::string message;
+    };
+
+    /*! Send one request body to FCM.
+     *
+     * @return nullopt on success, or the error.
+     */
+    [[nodiscard]] boost::asio::awaitable<std::optional<SendError>> sendRequest(
+        const std::string& url, const std::string& baerer, const std::string& body,
+        Trace *trace, size_t parent_span);
+    void warmup();
     [[nodiscard]] std::string createJwtToken() const;
     [[nodiscard]] boost::asio::awaitable<OAuthToken> getAccessToken();
     void loadServiceAccount();
@@ -93,9 +191,19 @@ private:
     boost::asio::io_context& ctx_;
     boost::asio::deadline_timer jwt_timer_{ctx_};
     ServiceAccount service_account_;
+    ConcurrencyLimiter limiter_{config_.concurrency};
+    std::shared_ptr<Tracer> tracer_;
     std::atomic<State> state_{State::STARTING}; // Indicates if the pusher is available
+    std::atomic<unsigned> active_pushes_{0};
+    std::atomic_bool cancel_pushes_{false}; // Set when the drain timeout expires
     std::mutex mutex_;
     std::atomic<std::shared_ptr<OAuthToken>> auth_token_;
+    std::vector<std::pair<size_t, state_listener_t>> state_listeners_;
+    std::vector<std::shared_ptr<boost::asio::steady_timer>> ready_waiters_;
+    std::shared_ptr<boost::asio::steady_timer> drain_waiter_; // Set while drain() waits. Protected by mutex_
+    size_t next_listener_id_{0};
+    GooglePusher *auth_source_{}; // Set if we follow another instance
+    size_t leader_listener_{};
 };
 
 }
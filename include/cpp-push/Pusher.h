@@ -1,16 +1,21 @@
 #pragma once
 
+#include <chrono>
+#include <functional>
 #include <string>
 #include <string_view>
 #include <filesystem>
 #include <string_view>
 #include <ranges>
 #include <variant>
+#include <vector>
 
 #include <boost/asio.hpp>
 
 namespace jgaa::cpp_push {
 
+class Trace;
+
 struct Config {
 
     struct Google {
@@ -20,9 +25,80 @@ struct Config {
         std::filesystem::path config_file{};
         int jwt_ttl_minutes{60}; // Time to live for the JWT token in minutes
         int jwt_refresh_minutes{3}; // Refresh the JWT token n minutes before the existing token expires
+
+        /*! Base URL for the FCM API. Only change this to test against a local stand-in.
+         * The URL for the OAuth tokens is `token_uri` in the service account file.
+         */
+        std::string fcm_url{"https://fcm.googleapis.com"};
+
+        /*! FCM rejects messages where the data and notification payload exceeds 4096 bytes.
+         * Larger messages are compacted if enabled, or rejected locally, before anything is sent.
+         * 0 disables the check.
+         */
+        size_t max_payload_bytes{4096};
+
+        /*! What we are allowed to do to make a too large message fit */
+        struct Compaction {
+            bool drop_optional_fields{false}; // Remove sound, click_action, tag, color, image and icon
+            bool truncate_body{false}; // Truncate the notification body, and end it with an ellipsis
+        };
+
+        Compaction compaction;
+
+        /*! Number of connections to FCM to open when the pusher starts, while it waits
+         * for the first OAuth token. This moves DNS lookup and the TCP and TLS handshakes
+         * out of the way of the first messages. 0 disables the warm-up.
+         *
+         * With `shards`, each shard has its own HTTP client and opens this many connections.
+         */
+        unsigned warmup_connections{0};
+
+        /*! Number of shards. With more than one, `createPusherForGoogle()` returns a pusher
+         * that distributes the device tokens over that many internal pushers, each with its own
+         * thread, io_context and HTTP client. All the shards share one OAuth token.
+         */
+        unsigned shards{1};
+    };
+
+    /*! Limits for how many requests the pusher sends in parallel.
+     *
+     * With `adaptive` enabled, the limit is adjusted between `min_limit` and `max_limit`
+     * from the observed round-trip time and error-rate of the requests.
+     */
+    struct Concurrency {
+        bool adaptive{true};
+        unsigned initial_limit{16};
+        unsigned min_limit{1};
+        unsigned max_limit{256};
+        double latency_tolerance{2.0}; // Back off when the RTT exceeds this factor times the lowest observed RTT
+        double backoff_ratio{0.9}; // Multiply the limit by this when backing off
+    };
+
+    /*! Optional tracing of push operations, with the time spent in each phase.
+     *
+     * Traces are exported as OpenTelemetry spans to a file (OTLP/JSON, one trace per line)
+     * and/or handed to a callback. The callback is called from the thread that completed
+     * the push, and must not block.
+     */
+    struct Tracing {
+        double sample_rate{0.0}; // Fraction of the push operations to trace, from 0.0 to 1.0
+        std::filesystem::path file{};
+        std::function<void(const Trace& trace)> callback;
+    };
+
+    /*! How `stop()` deals with pushes in progress.
+     *
+     * Pushes that are still sending when `drain_timeout` expires are cancelled.
+     * The tokens they did not send to are reported by `Pusher::Result::unsent()`.
+     */
+    struct Shutdown {
+        std::chrono::milliseconds drain_timeout{std::chrono::seconds{10}};
     };
 
     Google google;
+    Concurrency concurrency;
+    Tracing tracing;
+    Shutdown shutdown;
 };
 
 /*! Structure representing a notification message.
@@ -113,6 +189,15 @@ struct PushMessage {
 class Pusher {
 public:
     struct Result {
+        enum class Error {
+            NONE,
+            SEND_FAILED,        // The request failed, or was rejected by the server
+            PAYLOAD_TOO_LARGE,  // The message was rejected locally before anything was sent
+            TEMPLATE_NOT_FOUND, // No template matched the recipient
+            SHUTTING_DOWN,      // The pusher is stopping, and did not accept the message
+            CANCELLED           // The pusher stopped before the message was sent to all the tokens
+        };
+
         /*! Default constructor initializing success to false. */
         Result() = default;
 
@@ -121,7 +206,24 @@ public:
          * @param errorMessage The error message if any.
          */
         Result(bool success, const std::string& errorMessage, unsigned int num_successful)
-            : success_(success), num_successful_{num_successful}, message_(errorMessage) {}
+            : success_(success), error_{success ? Error::NONE : Error::SEND_FAILED}
+            , num_successful_{num_successful}, message_(errorMessage) {}
+
+        /*! Constructor for a failed push with a specific error.
+         * @param error The reason for the failure.
+         * @param errorMessage The error message.
+         */
+        Result(Error error, const std::string& errorMessage, unsigned int num_successful)
+            : success_(error == Error::NONE), error_{error}
+            , num_successful_{num_successful}, message_(errorMessage) {}
+
+        /*! Constructor for a failed push that did not reach all the tokens.
+         * @param unsent The tokens that no request was sent to.
+         */
+        Result(Error error, const std::string& errorMessage, unsigned int num_successful,
+               std::vector<std::string> unsent)
+            : success_(error == Error::NONE), error_{error}
+            , num_successful_{num_successful}, message_(errorMessage), unsent_{std::move(unsent)} {}
 
         Result(unsigned int num_successful)
             : success_(true), num_successful_{num_successful} {}
@@ -134,6 +236,10 @@ public:
             return success_;
         }
 
+        Error error() const noexcept {
+            return error_;
+        }
+
         std::string_view message() const noexcept {
             return message_;
         }
@@ -142,13 +248,24 @@ public:
             return num_successful_;
         }
 
+        /*! Tokens that were never sent to, because the push failed or was cancelled first.
+         *
+         * It's safe to send to these again. A token whose request failed is not
+         * included, as FCM may have delivered the message anyway.
+         */
+        const std::vector<std::string>& unsent() const noexcept {
+            return unsent_;
+        }
+
     private:
         /*! Indicates whether the push operation was successful. */
         bool success_{false};
+        Error error_{Error::NONE};
         unsigned int num_successful_{0}; // Number of successful pushes, if applicable
 
         /*! Contains the error message if the push operation failed. */
         std::string message_;
+        std::vector<std::string> unsent_;
     };
 
     /*! Virtual destructor to ensure proper cleanup of derived classes. */
@@ -165,7 +282,20 @@ public:
      */
     virtual bool isReady() const = 0;
 
+    /*! Wait until the pusher is ready to send messages.
+     *
+     * Returns as soon as the pusher becomes ready, so there is no need to poll `isReady()`.
+     *
+     * @param timeout Max time to wait.
+     * @return True if the pusher is ready, false if the timeout expired or the pusher is stopping.
+     */
+    [[nodiscard]] virtual boost::asio::awaitable<bool> waitReady(std::chrono::steady_clock::duration timeout) = 0;
+
     /*! Pure virtual function to stop the pusher.
+     *
+     * New pushes are rejected with `Result::Error::SHUTTING_DOWN`. Pushes in progress
+     * get up to `Config::Shutdown::drain_timeout` to finish before they are cancelled.
+     * Returns at once. The io_context runs out of work when the drain is done.
      */
     virtual void stop() = 0;
 };
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#include "cpp-push/GooglePusher.h"
+
+namespace jgaa::cpp_push {
+
+/*! Front end that spreads the work over several GooglePusher instances.
+ *
+ * Each device token is mapped to a shard with a consistent hash, so all the
+ * messages to one device are sent by the same shard. As long as the caller
+ * awaits one push before starting the next, messages to a device are
+ * delivered to FCM in order.
+ *
+ * Each shard has its own thread, io_context, HTTP client and concurrency limit.
+ * The first shard refreshes the OAuth token, and the others use its token.
+ * All the shards share one Tracer, so they write to the same trace file safely.
+ *
+ * The results from the shards are combined into one result.
+ *
+ * `stop()` drains all the shards in parallel. The destructor waits for the drain.
+ */
+class ShardedPusher : public Pusher {
+public:
+    /*! Constructor.
+     * @param config The configuration used for all the shards.
+     * @param shards Number of shards.
+     */
+    ShardedPusher(const Config& config, unsigned shards);
+    ~ShardedPusher() override;
+
+    bool isReady() const noexcept override;
+
+    [[nodiscard]] boost::asio::awaitable<bool> waitReady(std::chrono::steady_clock::duration timeout) override;
+    [[nodiscard]] boost::asio::awaitable<Result> push(const PushMessage& pm) override;
+    [[nodiscard]] boost::asio::awaitable<Result> gpush(const GooglePusher::GooglePushMessage& pm);
+
+    /*! Send a templated message. See `GooglePusher::gpush()`. */
+    [[nodiscard]] boost::asio::awaitable<Result> gpush(const GooglePusher::GooglePushMessage& pm,
+                                                       const TemplateCatalog& catalog,
+                                                       std::string_view template_id,
+                                                       std::span<const GooglePusher::Recipient> recipients);
+
+    void stop() override;
+
+    /*! The shard that handles `token` */
+    [[nodiscard]] size_t shardFor(std::string_view token) const noexcept;
+
+    [[nodiscard]] size_t numShards() const noexcept {
+        return shards_.size();
+    }
+
+    /*! Access a shard, for example to get its concurrency statistics */
+    [[nodiscard]] GooglePusher& shard(size_t index) {
+        return *shards_.at(index)->pusher;
+    }
+
+private:
+    struct Shard {
+        Shard(const Config& config, std::shared_ptr<Tracer> tracer);
+
+        boost::asio::io_context ctx;
+        std::unique_ptr<GooglePusher> pusher;
+        std::optional<boost::asio::executor_work_guard<boost::asio::io_context::executor_type>> work;
+        std::jthread thread;
+    };
+
+    /*! Counts a front-end push as in progress for as long as it lives.
+     *
+     * The shards keep their work guards until all of these are gone, so
+     * work spawned on a shard after `stop()` still runs.
+     */
+    class ActiveFanOut;
+
+    void releaseWorkLocked();
+
+    template <typename StartFn>
+    boost::asio::awaitable<Result> fanOut(const std::vector<size_t>& used, StartFn start);
+
+    std::shared_ptr<Tracer> tracer_; // Must outlive the shards
+    std::vector<std::unique_ptr<Shard>> shards_;
+    std::mutex mutex_;
+    bool stopped_{false};
+    unsigned active_fanouts_{0};
+};
+
+} // ns
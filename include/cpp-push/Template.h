@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace jgaa::cpp_push {
+
+/*! A notification text with `{name}` placeholders.
+ *
+ * The text is parsed once. The literal parts are also stored JSON-escaped, so
+ * rendering into a FCM payload only has to escape the substituted values.
+ *
+ * Use `{{` and `}}` for literal braces. Placeholders without a matching
+ * variable render as an empty string.
+ */
+class Template {
+public:
+    using vars_t = std::span<const std::pair<std::string_view, std::string_view>>;
+
+    /*! Parse a template.
+     * @throws std::invalid_argument if the text is not a valid template.
+     */
+    explicit Template(std::string_view text);
+
+    /*! Render the template as plain text */
+    [[nodiscard]] std::string render(vars_t vars) const;
+
+    /*! Append the rendered template to `out` as the content of a JSON string (without the quotes) */
+    void appendJson(std::string& out, vars_t vars) const;
+
+    /*! True if the template has no placeholders */
+    [[nodiscard]] bool isConstant() const noexcept {
+        return num_vars_ == 0;
+    }
+
+private:
+    struct Segment {
+        bool is_var{false};
+        uint32_t offset{}; // In names_ for placeholders, in literals_ for literals
+        uint32_t size{};
+        uint32_t json_offset{}; // In json_literals_
+        uint32_t json_size{};
+    };
+
+    static std::string_view lookup(std::string_view name, vars_t vars) noexcept;
+
+    std::string literals_;
+    std::string json_literals_;
+    std::string names_;
+    std::vector<Segment> segments_;
+    size_t num_vars_{};
+};
+
+/*! Title and body templates for one notification in one locale */
+struct NotificationTemplate {
+    std::optional<Template> title;
+    std::optional<Template> body;
+};
+
+/*! Notification templates, keyed by id and locale.
+ *
+ * Lookups do not allocate. The catalog must not be modified while it is used for sending.
+ */
+class TemplateCatalog {
+public:
+    explicit TemplateCatalog(std::string default_locale = "en")
+        : default_locale_{std::move(default_locale)} {}
+
+    /*! Add or replace the templates for `id` in `locale`.
+     *
+     * An empty title or body means that the notification has no title or body.
+     *
+     * @throws std::invalid_argument if a template can not be parsed.
+     */
+    void add(std::string_view id, std::string_view locale, std::string_view title, std::string_view body);
+
+    /*! Find the best match for `locale`.
+     *
+     * Tries the exact locale (like "nb-NO"), then the language alone ("nb"),
+     * and then the default locale.
+     *
+     * @return The templates, or nullptr if there are none for `id`.
+     */
+    [[nodiscard]] const NotificationTemplate *find(std::string_view id, std::string_view locale) const noexcept;
+
+    [[nodiscard]] const std::string& defaultLocale() const noexcept {
+        return default_locale_;
+    }
+
+private:
+    using locales_t = std::map<std::string, NotificationTemplate, std::less<>>;
+
+    std::string default_locale_;
+    std::map<std::string, locales_t, std::less<>> templates_;
+};
+
+} // ns
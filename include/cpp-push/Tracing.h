@@ -0,0 +1,150 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <variant>
+#include <vector>
+
+#include "cpp-push/Pusher.h"
+
+namespace jgaa::cpp_push {
+
+class Tracer;
+
+/*! A sampled trace of one push operation.
+ *
+ * The trace has a root span that starts and ends with the trace, and child spans
+ * for each phase of the operation. Timestamps are taken from the monotonic clock.
+ *
+ * When the Trace is destroyed, it is handed to the Tracer for export.
+ */
+class Trace {
+public:
+    using clock_t = std::chrono::steady_clock;
+    using trace_id_t = std::array<uint8_t, 16>;
+    using span_id_t = std::array<uint8_t, 8>;
+    using attribute_value_t = std::variant<std::string, int64_t>;
+
+    static constexpr size_t root = 0;
+
+    struct Span {
+        std::string_view name; // Must be a string literal
+        span_id_t id{};
+        size_t parent{root}; // Index of the parent span. Ignored for the root span.
+        clock_t::time_point start;
+        clock_t::time_point end;
+        std::vector<std::pair<std::string_view, attribute_value_t>> attributes;
+        bool error{false};
+    };
+
+    Trace(Tracer& tracer, std::string_view name);
+    Trace(const Trace&) = delete;
+    Trace& operator = (const Trace&) = delete;
+    ~Trace();
+
+    /*! Start a span.
+     * @return The index of the span.
+     */
+    size_t startSpan(std::string_view name, size_t parent = root);
+    void endSpan(size_t span);
+
+    void setAttribute(size_t span, std::string_view key, attribute_value_t value);
+    void setError(size_t span);
+
+    [[nodiscard]] const trace_id_t& traceId() const noexcept {
+        return trace_id_;
+    }
+
+    [[nodiscard]] const std::vector<Span>& spans() const noexcept {
+        return spans_;
+    }
+
+    /*! Render the trace as a single line of OTLP/JSON (an ExportTraceServiceRequest). */
+    [[nodiscard]] std::string toOtlpJson() const;
+
+private:
+    Tracer& tracer_;
+    trace_id_t trace_id_{};
+    std::vector<Span> spans_;
+};
+
+/*! Span that ends when it goes out of scope.
+ *
+ * Does nothing if `trace` is nullptr, so the same code can be used
+ * for sampled and unsampled operations.
+ */
+class ScopedSpan {
+public:
+    ScopedSpan(Trace *trace, std::string_view name, size_t parent = Trace::root)
+        : trace_{trace}, span_{trace ? trace->startSpan(name, parent) : Trace::root} {}
+
+    ScopedSpan(const ScopedSpan&) = delete;
+    ScopedSpan& operator = (const ScopedSpan&) = delete;
+
+    ~ScopedSpan() {
+        end();
+    }
+
+    void end() {
+        if (auto *trace = std::exchange(trace_, nullptr)) {
+            trace->endSpan(span_);
+        }
+    }
+
+    void setAttribute(std::string_view key, Trace::attribute_value_t value) {
+        if (trace_) {
+            trace_->setAttribute(span_, key, std::move(value));
+        }
+    }
+
+    void setError() {
+        if (trace_) {
+            trace_->setError(span_);
+        }
+    }
+
+    [[nodiscard]] size_t index() const noexcept {
+        return span_;
+    }
+
+private:
+    Trace *trace_;
+    size_t span_;
+};
+
+/*! Samples and exports traces according to `Config::Tracing`. */
+class Tracer {
+public:
+    explicit Tracer(const Config::Tracing& config);
+
+    /*! True if any traces will be sampled. */
+    [[nodiscard]] bool enabled() const noexcept {
+        return config_.sample_rate > 0.0 && (file_.is_open() || config_.callback);
+    }
+
+    /*! Start a trace if the sampler selects this operation.
+     * @return The trace, or nullptr if it is not sampled.
+     */
+    [[nodiscard]] std::unique_ptr<Trace> startTrace(std::string_view name);
+
+    /*! Convert a monotonic timestamp to nanoseconds since the UNIX epoch. */
+    [[nodiscard]] uint64_t toUnixNano(Trace::clock_t::time_point when) const noexcept;
+
+private:
+    friend class Trace;
+    void exportTrace(const Trace& trace) noexcept;
+
+    const Config::Tracing config_;
+    const std::chrono::system_clock::time_point system_anchor_{std::chrono::system_clock::now()};
+    const Trace::clock_t::time_point steady_anchor_{Trace::clock_t::now()};
+    std::mutex mutex_;
+    std::ofstream file_;
+};
+
+} // ns
@@ -51,7 +51,11 @@ int main(int argc, char* argv[]) {
         ("jwt-ttl", boost::program_options::value<int>(&config.google.jwt_ttl_minutes)->default_value(45),
          "JWT token time to live in minutes")
         ("jwt-refresh", boost::program_options::value<int>(&config.google.jwt_refresh_minutes)->default_value(3),
-         "Minutes before expiry to refresh the JWT token");
+         "Minutes before expiry to refresh the JWT token")
+        ("warmup", boost::program_options::value(&config.google.warmup_connections)->default_value(config.google.warmup_connections),
+         "Number of connections to open to FCM while waiting for the OAuth token")
+        ("shards", boost::program_options::value(&config.google.shards)->default_value(config.google.shards),
+         "Number of internal pushers, each with its own thread, to spread the device tokens over");
 
     //  Add command-line options to allow sending a message. Allow the user to set the values in pm.
     PushMessage pm;
@@ -169,9 +173,12 @@ int main(int argc, char* argv[]) {
     auto res = boost::asio::co_spawn(io_context, [&]() -> boost::asio::awaitable<int> {
 
         // Ensure the pusher is ready before proceeding
-        for(auto i = 0; i < 30 && !pusher->isReady(); ++i) {
-            LOG_DEBUG << "Waiting for pusher to become ready...";
-            co_await boost::asio::steady_timer(io_context, std::chrono::seconds(1)).async_wait(boost::asio::use_awaitable);
+        LOG_DEBUG << "Waiting for pusher to become ready...";
+        if (!co_await pusher->waitReady(std::chrono::seconds(30))) {
+            // Without an OAuth token, there is nothing we can send
+            LOG_ERROR << "The pusher did not become ready. Giving up.";
+            pusher->stop();
+            co_return 3;
         }
 
         try {
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <memory>
+
+#include <boost/asio.hpp>
+
+namespace jgaa::cpp_push {
+
+/*! Wake up a coroutine that waits, or is about to wait, on `timer`.
+ *
+ * The timer is expired from its own executor, so this can be called from
+ * any thread. Unlike `cancel()`, it also works if the waiter has not
+ * started waiting yet, because the wait then completes at once.
+ *
+ * @param owner Keeps the timer alive until the handler has run.
+ * @param timer The timer, owned by `owner`.
+ */
+template <typename T>
+void wakeTimer(std::shared_ptr<T> owner, boost::asio::steady_timer& timer)
+{
+    boost::asio::post(timer.get_executor(), [owner = std::move(owner), &timer] {
+        timer.expires_at(boost::asio::steady_timer::time_point::min());
+    });
+}
+
+/*! Wake up a coroutine that waits, or is about to wait, on a shared timer. */
+inline void wakeTimer(std::shared_ptr<boost::asio::steady_timer> timer)
+{
+    auto& t = *timer;
+    wakeTimer(std::move(timer), t);
+}
+
+} // ns
@@ -0,0 +1,188 @@
+
+#include <algorithm>
+#include <cassert>
+
+#include "cpp-push/ConcurrencyLimiter.h"
+#include "cpp-push/logging.h"
+#include "AsioHelpers.h"
+
+using namespace std;
+using namespace std::chrono_literals;
+
+namespace jgaa::cpp_push {
+
+namespace {
+
+// How often to re-evaluate the lowest observed RTT, so that a permanent
+// change in latency (like a new route to Google) does not keep us backed off.
+constexpr auto baseline_window = 30s;
+
+} // anon ns
+
+ConcurrencyLimiter::ConcurrencyLimiter(const Config::Concurrency &config)
+    : config_{config}
+    , limit_{static_cast<double>(clamp(config.initial_limit,
+                                       max(config.min_limit, 1u),
+                                       max(config.max_limit, max(config.min_limit, 1u))))}
+{
+}
+
+boost::asio::awaitable<ConcurrencyLimiter::Permit> ConcurrencyLimiter::acquire()
+{
+    auto ex = co_await boost::asio::this_coro::executor;
+    shared_ptr<Waiter> waiter;
+
+    {
+        lock_guard lock{mutex_};
+        if (closed_) {
+            co_return Permit{};
+        }
+
+        if (waiters_.empty() && in_flight_ < static_cast<unsigned>(limit_)) {
+            ++in_flight_;
+            co_return Permit{this};
+        }
+
+        waiter = make_shared<Waiter>(ex);
+        waiters_.push_back(waiter);
+    }
+
+    // grantLocked() counts us as in flight before it wakes us up.
+    boost::system::error_code ec;
+    co_await waiter->timer.async_wait(boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+    if (!waiter->granted) {
+        co_return Permit{};
+    }
+    co_return Permit{this};
+}
+
+void ConcurrencyLimiter::close()
+{
+    lock_guard lock{mutex_};
+    closed_ = true;
+
+    for(auto& waiter : waiters_) {
+        wakeTimer(waiter, waiter->timer);
+    }
+    waiters_.clear();
+}
+
+ConcurrencyLimiter::Stats ConcurrencyLimiter::stats() const
+{
+    using namespace std::chrono;
+
+    lock_guard lock{mutex_};
+    return {
+        static_cast<unsigned>(limit_),
+        in_flight_,
+        waiters_.size(),
+        min_rtt_ == clock_t::duration::max() ? microseconds{} : duration_cast<microseconds>(min_rtt_),
+        duration_cast<microseconds>(smoothed_rtt_),
+        num_ok_,
+        num_overload_,
+        num_failed_
+    };
+}
+
+ConcurrencyLimiter::Outcome ConcurrencyLimiter::classify(long http_status) noexcept
+{
+    if (http_status >= 200 && http_status < 300) {
+        return Outcome::OK;
+    }
+
+    // 0 means that we never got a HTTP response (timeout, connection failure...)
+    if (http_status == 0 || http_status == 429 || http_status >= 500) {
+        return Outcome::OVERLOAD;
+    }
+
+    return Outcome::FAILED;
+}
+
+void ConcurrencyLimiter::release(clock_t::duration rtt, Outcome outcome) noexcept
+{
+    const auto now = clock_t::now();
+
+    lock_guard lock{mutex_};
+    assert(in_flight_ > 0);
+    --in_flight_;
+
+    switch(outcome) {
+    case Outcome::OK:
+        ++num_ok_;
+        onSuccess(rtt, now);
+        break;
+    case Outcome::OVERLOAD:
+        ++num_overload_;
+        backOff(now);
+        break;
+    case Outcome::FAILED:
+        ++num_failed_;
+        break;
+    }
+
+    grantLocked();
+}
+
+void ConcurrencyLimiter::onSuccess(clock_t::duration rtt, clock_t::time_point now)
+{
+    smoothed_rtt_ = (smoothed_rtt_ == clock_t::duration{}) ? rtt : smoothed_rtt_ + (rtt - smoothed_rtt_) / 8;
+    window_min_rtt_ = min(window_min_rtt_, rtt);
+    min_rtt_ = min(min_rtt_, rtt);
+
+    if (now - window_started_ > baseline_window) {
+        min_rtt_ = window_min_rtt_;
+        window_min_rtt_ = clock_t::duration::max();
+        window_started_ = now;
+    }
+
+    if (!config_.adaptive) {
+        return;
+    }
+
+    if (rtt > min_rtt_ * config_.latency_tolerance) {
+        backOff(now);
+        return;
+    }
+
+    // Only grow the limit if we actually use it
+    if ((in_flight_ + 1) * 2 < static_cast<unsigned>(limit_)) {
+        return;
+    }
+
+    if (++ok_in_window_ >= static_cast<unsigned>(limit_)) {
+        ok_in_window_ = 0;
+        limit_ = min(limit_ + 1.0, static_cast<double>(max(config_.max_limit, 1u)));
+        LOG_TRACE_N << "Increased the concurrency limit to " << static_cast<unsigned>(limit_);
+    }
+}
+
+void ConcurrencyLimiter::backOff(clock_t::time_point now)
+{
+    if (!config_.adaptive) {
+        return;
+    }
+
+    // Many requests in flight will observe the same congestion. Back off at most once per RTT.
+    if (now - last_backoff_ < smoothed_rtt_) {
+        return;
+    }
+
+    last_backoff_ = now;
+    ok_in_window_ = 0;
+    limit_ = max(limit_ * config_.backoff_ratio, static_cast<double>(max(config_.min_limit, 1u)));
+    LOG_DEBUG_N << "Reduced the concurrency limit to " << static_cast<unsigned>(limit_);
+}
+
+void ConcurrencyLimiter::grantLocked()
+{
+    while(!waiters_.empty() && in_flight_ < static_cast<unsigned>(limit_)) {
+        auto waiter = std::move(waiters_.front());
+        waiters_.pop_front();
+        ++in_flight_;
+        waiter->granted = true;
+
+        wakeTimer(waiter, waiter->timer);
+    }
+}
+
+} // ns
@@ -0,0 +1,412 @@
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cassert>
+#include <charconv>
+#include <cstdint>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#   include <emmintrin.h>
+#   define CPP_PUSH_ESCAPE_SSE2 1
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+#   include <arm_neon.h>
+#   define CPP_PUSH_ESCAPE_NEON 1
+#endif
+
+#include "FcmMessageWriter.h"
+
+using namespace std;
+
+namespace jgaa::cpp_push {
+
+namespace {
+
+// Same rules as boost::json::serialize(): '"', '\\' and control characters
+// are escaped. Everything else, including UTF-8 sequences, is copied verbatim.
+constexpr bool needsEscape(unsigned char ch) noexcept {
+    return ch < 0x20 || ch == '"' || ch == '\\';
+}
+
+const char *findEscapeScalar(const char *p, const char *end) noexcept {
+    for(; p < end; ++p) {
+        if (needsEscape(static_cast<unsigned char>(*p))) {
+            break;
+        }
+    }
+    return p;
+}
+
+// Returns a pointer to the first character that must be escaped, or `end`
+const char *findEscape(const char *p, const char *end) noexcept {
+#if defined(CPP_PUSH_ESCAPE_SSE2)
+    const auto quote = _mm_set1_epi8('"');
+    const auto bslash = _mm_set1_epi8('\\');
+    const auto ctl = _mm_set1_epi8(0x1f);
+    for(; end - p >= 16; p += 16) {
+        const auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        // min(v, 0x1f) == v  <=>  v <= 0x1f (unsigned)
+        const auto m = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, bslash)),
+            _mm_cmpeq_epi8(_mm_min_epu8(v, ctl), v));
+        if (const auto mask = static_cast<unsigned>(_mm_movemask_epi8(m))) {
+            return p + countr_zero(mask);
+        }
+    }
+#elif defined(CPP_PUSH_ESCAPE_NEON)
+    const auto quote = vdupq_n_u8('"');
+    const auto bslash = vdupq_n_u8('\\');
+    const auto ctl = vdupq_n_u8(0x1f);
+    for(; end - p >= 16; p += 16) {
+        const auto v = vld1q_u8(reinterpret_cast<const uint8_t *>(p));
+        const auto m = vorrq_u8(vorrq_u8(vceqq_u8(v, quote), vceqq_u8(v, bslash)),
+                                vcleq_u8(v, ctl));
+        // vmaxvq_u8() is AArch64 only. Reduce the two halves so this also builds for ARMv7.
+        const auto m64 = vreinterpretq_u64_u8(m);
+        if (vgetq_lane_u64(m64, 0) | vgetq_lane_u64(m64, 1)) {
+            return findEscapeScalar(p, p + 16);
+        }
+    }
+#endif
+    return findEscapeScalar(p, end);
+}
+
+constexpr size_t escapedCharSize(char ch) noexcept {
+    switch(ch) {
+    case '"':
+    case '\\':
+    case '\b':
+    case '\f':
+    case '\n':
+    case '\r':
+    case '\t':
+        return 2;
+    default:
+        return 6;
+    }
+}
+
+void appendEscapedChar(string& out, char ch) {
+    static constexpr char hex[] = "0123456789abcdef";
+    switch(ch) {
+    case '"':
+        out.append("\\\"", 2);
+        break;
+    case '\\':
+        out.append("\\\\", 2);
+        break;
+    case '\b':
+        out.append("\\b", 2);
+        break;
+    case '\f':
+        out.append("\\f", 2);
+        break;
+    case '\n':
+        out.append("\\n", 2);
+        break;
+    case '\r':
+        out.append("\\r", 2);
+        break;
+    case '\t':
+        out.append("\\t", 2);
+        break;
+    default: {
+        const auto uch = static_cast<unsigned char>(ch);
+        const array<char, 6> buf{'\\', 'u', '0', '0', hex[uch >> 4], hex[uch & 0x0f]};
+        out.append(buf.data(), buf.size());
+    }
+    }
+}
+
+void appendString(string& out, string_view value) {
+    out += '"';
+    FcmMessageWriter::appendEscaped(out, value);
+    out += '"';
+}
+
+void appendMember(string& out, bool& first, string_view key, string_view value) {
+    if (!first) {
+        out += ',';
+    }
+    first = false;
+    appendString(out, key);
+    out += ':';
+    appendString(out, value);
+}
+
+void appendOptionalMember(string& out, bool& first, string_view key, string_view value) {
+    if (!value.empty()) {
+        appendMember(out, first, key, value);
+    }
+}
+
+// boost::json::object keeps the position of the first insertion of a key,
+// and assigning to an existing key replaces the value. Do the same for
+// duplicate keys in the data.
+void appendData(string& out, const PushMessage::data_t& data) {
+    out.append("\"data\":{");
+    bool first = true;
+    for(auto it = data.begin(); it != data.end(); ++it) {
+        const auto& key = it->first;
+        if (any_of(data.begin(), it, [&key](const auto& kv) { return kv.first == key; })) {
+            continue;
+        }
+        auto value = it->second;
+        for(auto later = next(it); later != data.end(); ++later) {
+            if (later->first == key) {
+                value = later->second;
+            }
+        }
+        appendMember(out, first, key, value);
+    }
+    out += '}';
+}
+
+void appendNotificationExtras(string& out, bool& first, const GooglePusher::GoogleNotification& n) {
+    appendOptionalMember(out, first, "sound", n.sound);
+    appendOptionalMember(out, first, "click_action", n.click_action);
+    appendOptionalMember(out, first, "tag", n.tag);
+    appendOptionalMember(out, first, "color", n.color);
+    appendOptionalMember(out, first, "image", n.image_url);
+    appendOptionalMember(out, first, "icon", n.icon);
+}
+
+void appendNotification(string& out, const GooglePusher::GoogleNotification& n) {
+    out.append("\"notification\":{");
+    bool first = true;
+    appendOptionalMember(out, first, "title", n.title);
+    appendOptionalMember(out, first, "body", n.body);
+    appendNotificationExtras(out, first, n);
+    out += '}';
+}
+
+// Like appendOptionalMember(), the member is left out if it renders as empty.
+void appendTemplateMember(string& out, bool& first, string_view key,
+                          const optional<Template>& tpl, Template::vars_t vars) {
+    if (!tpl) {
+        return;
+    }
+
+    const auto rollback = out.size();
+    if (!first) {
+        out += ',';
+    }
+    appendString(out, key);
+    out.append(":\"");
+    const auto start = out.size();
+    tpl->appendJson(out, vars);
+    if (out.size() == start) {
+        out.resize(rollback);
+        return;
+    }
+    out += '"';
+    first = false;
+}
+
+void appendAndroid(string& out, const GooglePusher::GooglePushMessage& pm) {
+    // Same arithmetic as the original format("{}s", pm.ttl_minutes * 60)
+    const uint32_t ttl = pm.ttl_minutes * 60;
+    array<char, 16> buf;
+    const auto [end, ec] = to_chars(buf.data(), buf.data() + buf.size(), ttl);
+    assert(ec == errc{});
+
+    out.append("\"android\":{\"ttl\":\"");
+    out.append(buf.data(), end);
+    out.append("s\",\"priority\":");
+    out.append(pm.priority == GooglePusher::AndroidPriority::High ? "\"HIGH\"" : "\"NORMAL\"");
+    out += '}';
+}
+
+} // anon ns
+
+void FcmMessageWriter::appendEscaped(string& out, string_view value)
+{
+    const char *p = value.data();
+    const char *const end = p + value.size();
+
+    while(p < end) {
+        const auto *special = findEscape(p, end);
+        out.append(p, special);
+        if (special == end) {
+            break;
+        }
+        appendEscapedChar(out, *special);
+        p = special + 1;
+    }
+}
+
+size_t FcmMessageWriter::escapedSize(string_view value) noexcept
+{
+    const char *p = value.data();
+    const char *const end = p + value.size();
+    auto size = value.size();
+
+    while((p = findEscape(p, end)) != end) {
+        size += escapedCharSize(*p) - 1;
+        ++p;
+    }
+
+    return size;
+}
+
+string_view FcmMessageWriter::truncateEscaped(string_view text, size_t max_size) noexcept
+{
+    size_t size = 0, len = 0;
+    for(; len < text.size(); ++len) {
+        const auto ch_size = escapedSize(text.substr(len, 1));
+        if (size + ch_size > max_size) {
+            break;
+        }
+        size += ch_size;
+    }
+
+    // Don't split a UTF-8 sequence
+    while(len > 0 && len < text.size() && (static_cast<unsigned char>(text[len]) & 0xc0) == 0x80) {
+        --len;
+    }
+
+    return text.substr(0, len);
+}
+
+bool FcmMessageWriter::prepareCompacted(const Config::Google& config,
+                                        const GooglePusher::GooglePushMessage& pm,
+                                        GooglePusher::GooglePushMessage& compacted,
+                                        string& body_buffer)
+{
+    const auto max_size = config.max_payload_bytes;
+    if (!pm.notification) {
+        return false;
+    }
+
+    compacted = pm;
+    auto& n = *compacted.notification;
+
+    if (config.compaction.drop_optional_fields) {
+        n.sound = {};
+        n.click_action = {};
+        n.tag = {};
+        n.color = {};
+        n.image_url = {};
+        n.icon = {};
+    }
+
+    prepare(compacted);
+    if (payloadSize() <= max_size) {
+        return true;
+    }
+
+    if (config.compaction.truncate_body && !n.body.empty()) {
+        constexpr string_view ellipsis = "\xe2\x80\xa6"; // U+2026 in UTF-8
+        const auto over = payloadSize() - max_size;
+        const auto body_size = escapedSize(n.body);
+        if (body_size > over + ellipsis.size()) {
+            body_buffer = truncateEscaped(n.body, body_size - over - ellipsis.size());
+            body_buffer += ellipsis;
+            n.body = body_buffer;
+        } else {
+            n.body = {};
+        }
+        prepare(compacted);
+        return payloadSize() <= max_size;
+    }
+
+    return false;
+}
+
+void FcmMessageWriter::prepare(const GooglePusher::GooglePushMessage &pm)
+{
+    prefix_.clear();
+    dry_run_ = pm.dry_run;
+
+    prefix_.append("{\"message\":{");
+
+    payload_size_ = 0;
+    if (!pm.data.empty()) {
+        const auto start = prefix_.size();
+        appendData(prefix_, pm.data);
+        payload_size_ += prefix_.size() - start;
+        prefix_ += ',';
+    }
+
+    if (pm.notification) {
+        const auto start = prefix_.size();
+        appendNotification(prefix_, *pm.notification);
+        payload_size_ += prefix_.size() - start;
+        prefix_ += ',';
+    }
+
+    appendAndroid(prefix_, pm);
+    prefix_.append(",\"token\":\"");
+}
+
+void FcmMessageWriter::prepareTemplated(const GooglePusher::GooglePushMessage &pm)
+{
+    prefix_.clear();
+    notification_extras_.clear();
+    suffix_.clear();
+    dry_run_ = pm.dry_run;
+
+    prefix_.append("{\"message\":{");
+
+    payload_size_ = 0;
+    if (!pm.data.empty()) {
+        const auto start = prefix_.size();
+        appendData(prefix_, pm.data);
+        payload_size_ += prefix_.size() - start;
+        prefix_ += ',';
+    }
+
+    if (pm.notification) {
+        bool first = true;
+        appendNotificationExtras(notification_extras_, first, *pm.notification);
+    }
+
+    suffix_ += ',';
+    appendAndroid(suffix_, pm);
+    suffix_.append(",\"token\":\"");
+}
+
+void FcmMessageWriter::write(string &out, string_view token) const
+{
+    out.reserve(out.size() + prefix_.size() + token.size() + dry_run_member.size() + 8);
+    out.append(prefix_);
+    appendTail(out, token);
+}
+
+size_t FcmMessageWriter::writeTemplated(string &out, string_view token,
+                                        const NotificationTemplate &tpl, Template::vars_t vars) const
+{
+    out.reserve(out.size() + prefix_.size() + notification_extras_.size() + suffix_.size()
+                + token.size() + dry_run_member.size() + 256);
+    out.append(prefix_);
+
+    const auto start = out.size();
+    out.append("\"notification\":{");
+    bool first = true;
+    appendTemplateMember(out, first, "title", tpl.title, vars);
+    appendTemplateMember(out, first, "body", tpl.body, vars);
+    if (!notification_extras_.empty()) {
+        if (!first) {
+            out += ',';
+        }
+        out.append(notification_extras_);
+    }
+    out += '}';
+    const auto notification_size = out.size() - start;
+
+    out.append(suffix_);
+    appendTail(out, token);
+    return payload_size_ + notification_size;
+}
+
+void FcmMessageWriter::appendTail(string &out, string_view token) const
+{
+    appendEscaped(out, token);
+    out.append("\"}");
+    if (dry_run_) {
+        out.append(dry_run_member);
+    }
+    out += '}';
+}
+
+} // ns
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+#include "cpp-push/GooglePusher.h"
+#include "cpp-push/Template.h"
+
+namespace jgaa::cpp_push {
+
+/*! Direct-to-buffer JSON writer for FCM v1 `messages:send` requests.
+ *
+ * Produces exactly the same bytes as building the request from nested
+ * boost::json::object's and calling boost::json::serialize(), but without
+ * the intermediate objects and string copies.
+ *
+ * The part of the request that is the same for all the recipients of a
+ * message is rendered once by `prepare()`. `write()` then appends the
+ * complete request for one device token to a buffer owned by the caller,
+ * so the same buffer can be re-used for all the tokens.
+ */
+class FcmMessageWriter {
+public:
+    /*! Render the recipient independent part of the request.
+     *
+     * @param pm The message. The writer does not keep any references to it.
+     */
+    void prepare(const GooglePusher::GooglePushMessage& pm);
+
+    /*! Append the complete request body for `token` to `out`. */
+    void write(std::string& out, std::string_view token) const;
+
+    /*! Render the recipient independent part of a templated request.
+     *
+     * The title and body in `pm.notification` are ignored. They are
+     * rendered from a template for each recipient by `writeTemplated()`.
+     */
+    void prepareTemplated(const GooglePusher::GooglePushMessage& pm);
+
+    /*! Append the complete request body for `token` to `out`, with the title and body rendered from `tpl`.
+     *
+     * Requires `prepareTemplated()`.
+     *
+     * @return The payload size of this request, as counted by `payloadSize()`.
+     */
+    size_t writeTemplated(std::string& out, std::string_view token,
+                          const NotificationTemplate& tpl, Template::vars_t vars) const;
+
+    /*! Size of the encoded data and notification members of the prepared message.
+     *
+     * This includes the `"data":` and `"notification":` keys and the braces, so it
+     * is a conservative upper bound of what FCM counts against its payload limit.
+     */
+    [[nodiscard]] size_t payloadSize() const noexcept {
+        return payload_size_;
+    }
+
+    /*! Make the message fit in `config.max_payload_bytes`, as allowed by `config.compaction`.
+     *
+     * Optional notification fields are dropped first, then the body is truncated
+     * and ended with an ellipsis. The writer is left prepared for `compacted`.
+     *
+     * @param compacted Set to the message to send. It may refer to `pm` and `body_buffer`.
+     * @param body_buffer Storage for the truncated body.
+     * @return true if the prepared message fits.
+     */
+    bool prepareCompacted(const Config::Google& config,
+                          const GooglePusher::GooglePushMessage& pm,
+                          GooglePusher::GooglePushMessage& compacted,
+                          std::string& body_buffer);
+
+    /*! Append `value` to `out` as the content of a JSON string (without the quotes). */
+    static void appendEscaped(std::string& out, std::string_view value);
+
+    /*! Number of bytes `appendEscaped()` will add for `value`. */
+    [[nodiscard]] static size_t escapedSize(std::string_view value) noexcept;
+
+    /*! The longest prefix of `text` that is at most `max_size` bytes when escaped, without splitting a UTF-8 sequence. */
+    [[nodiscard]] static std::string_view truncateEscaped(std::string_view text, size_t max_size) noexcept;
+
+private:
+    static constexpr std::string_view dry_run_member = ",\"dry_run\":true";
+
+    void appendTail(std::string& out, std::string_view token) const;
+
+    std::string prefix_;
+    std::string notification_extras_; // Templated requests only
+    std::string suffix_; // Templated requests only
+    size_t payload_size_{};
+    bool dry_run_{false};
+};
+
+} // ns
@@ -1,10 +1,14 @@
 
+#include <cassert>
 #include <chrono>
 #include <span>
 #include <boost/json.hpp>
 #include <boost/url.hpp>
 #include "cpp-push/GooglePusher.h"
+#include "cpp-push/ShardedPusher.h"
 #include "cpp-push/logging.h"
+#include "AsioHelpers.h"
+#include "FcmMessageWriter.h"
 
 #include <jwt-cpp/jwt.h>
 
@@ -49,104 +53,276 @@ service_account_t tag_invoke(json::value_to_tag<service_account_t>, json::value
 
 namespace jgaa::cpp_push {
 
-GooglePusher::GooglePusher(const Config &config,  boost::asio::io_context& ctx)
-    : config_(config), ctx_{ctx} {
+namespace {
+
+// The tokens from `from` to `end`, for Result::unsent()
+template <typename It, typename Proj>
+vector<string> unsentTokens(It from, It end, Proj proj) {
+    vector<string> tokens;
+    for(; from != end; ++from) {
+        tokens.emplace_back(proj(*from));
+    }
+    return tokens;
+}
+
+constexpr auto token_of = [](string_view token) { return token; };
+// How long cancelled pushes get to return during shutdown
+constexpr auto cancel_grace = 2s;
+
+constexpr auto recipient_token_of = [](const GooglePusher::Recipient& r) { return r.token; };
+
+} // anon ns
+
+class GooglePusher::ActivePush {
+public:
+    explicit ActivePush(GooglePusher& pusher) noexcept
+        : pusher_{pusher} {
+        ++pusher_.active_pushes_;
+    }
+
+    ActivePush(const ActivePush&) = delete;
+    ActivePush& operator = (const ActivePush&) = delete;
+
+    ~ActivePush() {
+        if (--pusher_.active_pushes_ == 0) {
+            // Let drain() know that we are done. Once drain() has returned, there is
+            // no one to notify, and the pusher may already be gone when the handler runs.
+            std::lock_guard lock{pusher_.mutex_};
+            if (pusher_.drain_waiter_) {
+                wakeTimer(pusher_.drain_waiter_);
+            }
+        }
+    }
+
+    // Must be checked after the push is counted, so drain() can't miss it
+    [[nodiscard]] bool accepted() const noexcept {
+        return pusher_.state_.load() < State::STOPPING;
+    }
+
+private:
+    GooglePusher& pusher_;
+};
+
+GooglePusher::GooglePusher(const Config &config,  boost::asio::io_context& ctx,
+                           std::shared_ptr<Tracer> tracer)
+    : config_(config), ctx_{ctx}
+    , tracer_{tracer ? std::move(tracer) : std::make_shared<Tracer>(config_.tracing)} {
 
     loadServiceAccount();
 }
 
 boost::asio::awaitable<Pusher::Result> GooglePusher::gpush(const GooglePushMessage &pm)
 {
-    const auto url = format("https://fcm.googleapis.com/v1/projects/{}/messages:send",
-                            service_account_.project_id);
+    const PushMessage::tokens_view tokens{pm.to};
+
+    const ActivePush active{*this};
+    if (!active.accepted()) {
+        co_return Pusher::Result{Pusher::Result::Error::SHUTTING_DOWN, "The pusher is shutting down", 0,
+                                 unsentTokens(tokens.begin(), tokens.end(), token_of)};
+    }
 
-    boost::json::object message;
+    const auto url = format("{}/v1/projects/{}/messages:send",
+                            config_.google.fcm_url, service_account_.project_id);
+
+    // Sampled traces are exported when `trace` goes out of scope
+    const auto trace = tracer_->startTrace("cpp_push.gpush");
+    ScopedSpan prepare_span{trace.get(), "prepare"};
+
+    FcmMessageWriter writer;
+    writer.prepare(pm);
+
+    // FCM would reject an oversized message for every single token. Deal with it here.
+    GooglePushMessage compacted;
+    std::string body_buffer;
+    if (const auto max_size = config_.google.max_payload_bytes; max_size && writer.payloadSize() > max_size) {
+        const auto size = writer.payloadSize();
+        if (!writer.prepareCompacted(config_.google, pm, compacted, body_buffer)) {
+            LOG_WARN_N << "The payload of the message is " << size
+                       << " bytes. The limit is " << max_size << " bytes.";
+            prepare_span.setError();
+            co_return Pusher::Result{Pusher::Result::Error::PAYLOAD_TOO_LARGE,
+                                     format("Payload too large: {} bytes", size), 0,
+                                     unsentTokens(tokens.begin(), tokens.end(), token_of)};
+        }
 
-    if (!pm.data.empty()) {
-        boost::json::object data;
-        for (auto& kv : pm.data)
-            data[std::string(kv.first)] = std::string(kv.second);
-        message["data"] = data;
+        LOG_DEBUG_N << "Compacted the payload of the message from " << size
+                    << " to " << writer.payloadSize() << " bytes.";
     }
 
-    boost::json::object android;
-    android["ttl"] = format("{}s", pm.ttl_minutes * 60);
-    android["priority"] = (pm.priority == AndroidPriority::High ? "HIGH" : "NORMAL");
+    const auto baerer = format("Bearer {}", getAuth()->access_token);
+    prepare_span.setAttribute("payload_bytes", static_cast<int64_t>(writer.payloadSize()));
+    prepare_span.end();
 
-    if (pm.notification) {
-        boost::json::object notif;
-        if (!pm.notification->title.empty()) {
-            notif["title"] = pm.notification->title;
-        }
-        if (!pm.notification->body.empty()) {
-            notif["body"] = pm.notification->body;
-        }
-        if (!pm.notification->sound.empty()) {
-            notif["sound"] = pm.notification->sound;
-        }
-        if (!pm.notification->click_action.empty()) {
-            notif["click_action"] = pm.notification->click_action;
-        }
-        if (!pm.notification->tag.empty()) {
-            notif["tag"] = pm.notification->tag;
-        }
-        if (!pm.notification->color.empty()) {
-            notif["color"] = pm.notification->color;
+    auto num_successful = 0u;
+    std::string body;
+
+    for(auto it = tokens.begin(); it != tokens.end(); ++it) {
+        const auto token = *it;
+        if (cancel_pushes_) {
+            co_return Pusher::Result{Pusher::Result::Error::CANCELLED, "Cancelled by shutdown", num_successful,
+                                     unsentTokens(it, tokens.end(), token_of)};
         }
-        if (!pm.notification->image_url.empty()) {
-            notif["image"] = pm.notification->image_url;
+
+        ScopedSpan token_span{trace.get(), "token"};
+        token_span.setAttribute("token", std::string{token.substr(0, 16)});
+
+        {
+            ScopedSpan span{trace.get(), "serialize", token_span.index()};
+            body.clear();
+            writer.write(body, token);
         }
-        if (!pm.notification->icon.empty()) {
-            notif["icon"] = pm.notification->icon;
+
+        LOG_TRACE_N << "Sending push message to token: " << token.substr(0, 16) << "..."
+                    << " with body: " << body;
+
+        if (auto error = co_await sendRequest(url, baerer, body, trace.get(), token_span.index())) {
+            // A failed request may still have been delivered, so it's not reported as unsent
+            auto unsent_from = it;
+            if (error->error != Pusher::Result::Error::CANCELLED) {
+                ++unsent_from;
+            }
+            co_return Pusher::Result{error->error, error->message, num_successful,
+                                     unsentTokens(unsent_from, tokens.end(), token_of)};
         }
 
-        message["notification"] = notif;
+        ++num_successful;
     }
 
-    message["android"] = android;
+    co_return Pusher::Result{num_successful};
+}
+
+boost::asio::awaitable<Pusher::Result> GooglePusher::gpush(const GooglePushMessage &pm,
+                                                           const TemplateCatalog &catalog,
+                                                           std::string_view template_id,
+                                                           std::span<const Recipient> recipients)
+{
+    const ActivePush active{*this};
+    if (!active.accepted()) {
+        co_return Pusher::Result{Pusher::Result::Error::SHUTTING_DOWN, "The pusher is shutting down", 0,
+                                 unsentTokens(recipients.begin(), recipients.end(), recipient_token_of)};
+    }
+
+    const auto url = format("{}/v1/projects/{}/messages:send",
+                            config_.google.fcm_url, service_account_.project_id);
+
+    const auto trace = tracer_->startTrace("cpp_push.gpush_templated");
+    ScopedSpan prepare_span{trace.get(), "prepare"};
+    prepare_span.setAttribute("template", std::string{template_id});
+
+    FcmMessageWriter writer;
+    writer.prepareTemplated(pm);
+
     const auto baerer = format("Bearer {}", getAuth()->access_token);
+    prepare_span.end();
 
     auto num_successful = 0u;
+    std::string body;
 
-    for(const auto& token : PushMessage::tokens_view{pm.to}) {
-        boost::json::object root;
-        message["token"] = token;
-        root["message"] = message;
-        // Wrap and optional dry_run
-        if (pm.dry_run) {
-            root["dry_run"] = true;
+    for(auto it = recipients.begin(); it != recipients.end(); ++it) {
+        const auto& recipient = *it;
+        if (cancel_pushes_) {
+            co_return Pusher::Result{Pusher::Result::Error::CANCELLED, "Cancelled by shutdown", num_successful,
+                                     unsentTokens(it, recipients.end(), recipient_token_of)};
         }
 
-        const auto body = boost::json::serialize(root);
-        LOG_TRACE_N << "Sending push message to token: " << token.substr(0, 16) << "..."
-                    << " with body: " << body;
+        ScopedSpan token_span{trace.get(), "token"};
+        token_span.setAttribute("token", std::string{recipient.token.substr(0, 16)});
 
-        try {
-            const auto res = co_await rest_.Build()->Post(url)
-                .Header("Authorization", baerer)
-                .WithJson()
-                .AcceptJson()
-                .SendData(body)
-                .AsioAsyncExecute(boost::asio::use_awaitable);
-
-            if (!res.isOk()) {
-                LOG_WARN_N << "Failed to send push message: "
-                           << res.msg;
-                co_return Pusher::Result{false, res.msg, num_successful};
+        {
+            ScopedSpan span{trace.get(), "serialize", token_span.index()};
+
+            const auto *tpl = catalog.find(template_id, recipient.locale);
+            if (!tpl) {
+                span.setError();
+                LOG_WARN_N << "No template " << template_id << " for locale " << recipient.locale;
+                co_return Pusher::Result{Pusher::Result::Error::TEMPLATE_NOT_FOUND,
+                                         format("No template {} for locale {}", template_id, recipient.locale),
+                                         num_successful,
+                                         unsentTokens(it, recipients.end(), recipient_token_of)};
             }
 
-            ++num_successful;
+            body.clear();
+            const auto payload_size = writer.writeTemplated(body, recipient.token, *tpl, recipient.vars);
+            if (const auto max_size = config_.google.max_payload_bytes; max_size && payload_size > max_size) {
+                span.setError();
+                LOG_WARN_N << "The rendered payload for token " << recipient.token.substr(0, 16)
+                           << "... is " << payload_size << " bytes. The limit is " << max_size << " bytes.";
+                co_return Pusher::Result{Pusher::Result::Error::PAYLOAD_TOO_LARGE,
+                                         format("Payload too large: {} bytes", payload_size),
+                                         num_successful,
+                                         unsentTokens(it, recipients.end(), recipient_token_of)};
+            }
+        }
 
-        } catch (const boost::system::system_error& e) {
-            LOG_WARN_N << "Failed to send push message: " << e.what();
-            co_return Pusher::Result{false, e.code().message(), num_successful};
+        LOG_TRACE_N << "Sending templated push message to token: " << recipient.token.substr(0, 16) << "..."
+                    << " with body: " << body;
+
+        if (auto error = co_await sendRequest(url, baerer, body, trace.get(), token_span.index())) {
+            auto unsent_from = it;
+            if (error->error != Pusher::Result::Error::CANCELLED) {
+                ++unsent_from;
+            }
+            co_return Pusher::Result{error->error, error->message, num_successful,
+                                     unsentTokens(unsent_from, recipients.end(), recipient_token_of)};
         }
+
+        ++num_successful;
     }
 
     co_return Pusher::Result{num_successful};
 }
 
+boost::asio::awaitable<std::optional<GooglePusher::SendError>> GooglePusher::sendRequest(
+    const std::string &url, const std::string &baerer, const std::string &body,
+    Trace *trace, size_t parent_span)
+{
+    ScopedSpan queue_span{trace, "queue", parent_span};
+    auto permit = co_await limiter_.acquire();
+    if (!permit) {
+        // The limiter is closed when the drain timeout expires
+        queue_span.setError();
+        co_return SendError{Pusher::Result::Error::CANCELLED, "Cancelled by shutdown"};
+    }
+    queue_span.end();
+
+    // Includes the time the request waits for restincurl's worker-thread
+    ScopedSpan request_span{trace, "request", parent_span};
+
+    try {
+        const auto res = co_await rest_.Build()->Post(url)
+            .Header("Authorization", baerer)
+            .Option(CURLOPT_TCP_KEEPALIVE, 1L)
+            .WithJson()
+            .AcceptJson()
+            .SendData(body)
+            .AsioAsyncExecute(boost::asio::use_awaitable);
+
+        permit.done(ConcurrencyLimiter::classify(res.http_response_code));
+        request_span.setAttribute("http.response.status_code", static_cast<int64_t>(res.http_response_code));
+
+        if (!res.isOk()) {
+            request_span.setError();
+            LOG_WARN_N << "Failed to send push message: "
+                       << res.msg;
+            co_return SendError{Pusher::Result::Error::SEND_FAILED, res.msg};
+        }
+
+    } catch (const boost::system::system_error& e) {
+        permit.done(ConcurrencyLimiter::Outcome::OVERLOAD);
+        request_span.setError();
+        LOG_WARN_N << "Failed to send push message: " << e.what();
+        co_return SendError{Pusher::Result::Error::SEND_FAILED, e.code().message()};
+    }
+
+    co_return std::nullopt;
+}
+
 boost::asio::awaitable<Pusher::Result> GooglePusher::push(const PushMessage &pm)
+{
+    co_return co_await gpush(toGooglePushMessage(pm));
+}
+
+GooglePusher::GooglePushMessage GooglePusher::toGooglePushMessage(const PushMessage &pm)
 {
     GooglePushMessage gpm;
     gpm.to = pm.to;
@@ -162,7 +338,7 @@ boost::asio::awaitable<Pusher::Result> GooglePusher::push(const PushMessage &pm)
             pm.notification->sound
         };
     }
-    co_return co_await gpush(gpm);
+    return gpm;
 }
 
 void GooglePusher::run()
@@ -171,19 +347,128 @@ void GooglePusher::run()
                           boost::asio::detached);
 }
 
+void GooglePusher::follow(GooglePusher &leader)
+{
+    assert(!auth_source_);
+    auth_source_ = &leader;
+
+    // Mirror the availability of the leader. We stop on our own.
+    leader_listener_ = leader.addStateListener([this](State state) {
+        if (state <= State::ERROR) {
+            setStateUnlessStopping(state);
+        }
+    });
+
+    if (const auto state = leader.getState(); state <= State::ERROR) {
+        setStateUnlessStopping(state);
+    }
+
+    // We have our own HTTP client, so it needs its own warm connections
+    if (config_.google.warmup_connections) {
+        warmup();
+    }
+}
+
 void GooglePusher::stop()
 {
     LOG_INFO_N << "Stopping GooglePusher...";
+    if (getState() >= State::STOPPING) {
+        return;
+    }
+
     setState(State::STOPPING);
     jwt_timer_.cancel();
+
+    if (auth_source_) {
+        // Followers don't have a run_() loop to clean up after them.
+        auth_source_->removeStateListener(leader_listener_);
+        boost::asio::co_spawn(ctx_, drain(), boost::asio::detached);
+    }
 }
 
 void GooglePusher::setState(State state)
 {
-    if (state != state_) {
-        LOG_DEBUG_N << "state changed from "
-                    << state_ << " to " << state;
-        state_ = state;
+    const auto old_state = state_.exchange(state);
+    if (state == old_state) {
+        return;
+    }
+
+    onStateChanged(old_state, state);
+}
+
+void GooglePusher::setStateUnlessStopping(State state)
+{
+    // Check and set in one step, so we can't overwrite STOPPING set by stop() on another thread
+    auto old_state = state_.load();
+    do {
+        if (old_state > State::ERROR || old_state == state) {
+            return;
+        }
+    } while(!state_.compare_exchange_weak(old_state, state));
+
+    onStateChanged(old_state, state);
+}
+
+void GooglePusher::onStateChanged(State old_state, State state)
+{
+    LOG_DEBUG_N << "state changed from "
+                << old_state << " to " << state;
+
+    decltype(state_listeners_) listeners;
+    {
+        std::lock_guard lock{mutex_};
+        listeners = state_listeners_;
+
+        // Wake up everyone in waitReady(). They will check the state themselves.
+        for(auto& waiter : ready_waiters_) {
+            wakeTimer(waiter);
+        }
+        ready_waiters_.clear();
+    }
+
+    for(auto& [_, listener] : listeners) {
+        listener(state);
+    }
+}
+
+size_t GooglePusher::addStateListener(state_listener_t listener)
+{
+    std::lock_guard lock{mutex_};
+    const auto id = ++next_listener_id_;
+    state_listeners_.emplace_back(id, std::move(listener));
+    return id;
+}
+
+void GooglePusher::removeStateListener(size_t id)
+{
+    std::lock_guard lock{mutex_};
+    std::erase_if(state_listeners_, [id](const auto& v) { return v.first == id; });
+}
+
+boost::asio::awaitable<bool> GooglePusher::waitReady(std::chrono::steady_clock::duration timeout)
+{
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+    auto waiter = std::make_shared<boost::asio::steady_timer>(co_await boost::asio::this_coro::executor);
+
+    while(true) {
+        {
+            std::lock_guard lock{mutex_};
+            const auto state = getState();
+            if (state == State::AVAILABLE) {
+                co_return true;
+            }
+            if (state >= State::STOPPING || std::chrono::steady_clock::now() >= deadline) {
+                co_return false;
+            }
+            waiter->expires_at(deadline);
+            ready_waiters_.push_back(waiter);
+        }
+
+        boost::system::error_code ec;
+        co_await waiter->async_wait(boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+
+        std::lock_guard lock{mutex_};
+        std::erase(ready_waiters_, waiter);
     }
 }
 
@@ -191,9 +476,18 @@ boost::asio::awaitable<void> GooglePusher::run_()
 {
     LOG_INFO_N << "Starting...";
 
-    while(state_ <= State::ERROR) {
+    if (config_.google.warmup_connections) {
+        warmup();
+    }
+
+    // stop() may be called while we are suspended, so check the state after each co_await,
+    // and never overwrite STOPPING.
+    while(getState() <= State::ERROR) {
         try {
             auto token = co_await getAccessToken();
+            if (getState() >= State::STOPPING) {
+                break;
+            }
             const int refresh_after = chrono::duration_cast<chrono::minutes>(
                                           token.expiry - std::chrono::system_clock::now()
                                           - std::chrono::minutes(config_.google.jwt_refresh_minutes))
@@ -203,26 +497,116 @@ boost::asio::awaitable<void> GooglePusher::run_()
                         << " minutes, refreshing after " << refresh_after << " minutes";
             jwt_timer_.expires_from_now(boost::posix_time::minutes(max(1, refresh_after)));
             setAuthToken(std::make_shared<OAuthToken>(std::move(token)));
-            setState(State::AVAILABLE);
+            setStateUnlessStopping(State::AVAILABLE);
         } catch (const std::exception& e) {
+            if (getState() >= State::STOPPING) {
+                break;
+            }
             LOG_WARN_N << "Error creating JWT token: " << e.what();
-            setState(State::ERROR);
+            setStateUnlessStopping(State::ERROR);
             jwt_timer_.expires_from_now(boost::posix_time::seconds(30));
         }
 
+        if (getState() >= State::STOPPING) {
+            break;
+        }
+
         try {
             co_await jwt_timer_.async_wait(boost::asio::use_awaitable);
         } catch (const boost::system::system_error& e) {
             if (e.code() != boost::asio::error::operation_aborted) {
                 LOG_WARN_N << "JWT timer error: " << e.what();
-                setState(State::ERROR);
+                setStateUnlessStopping(State::ERROR);
             }
         }
     }
 
+    co_await drain();
+    LOG_INFO_N << "Done.";
+}
+
+boost::asio::awaitable<void> GooglePusher::drain()
+{
+    using clock_t = boost::asio::steady_timer::clock_type;
+
+    auto timer = make_shared<boost::asio::steady_timer>(ctx_);
+    {
+        std::lock_guard lock{mutex_};
+        drain_waiter_ = timer;
+    }
+
+    if (const auto active = active_pushes_.load()) {
+        LOG_INFO_N << "Waiting up to " << config_.shutdown.drain_timeout.count()
+                   << " ms for " << active << " push(es) to finish.";
+    }
+
+    if (!co_await waitForPushes(*timer, clock_t::now() + config_.shutdown.drain_timeout)) {
+        LOG_WARN_N << "Drain timeout expired. Cancelling " << active_pushes_.load() << " push(es).";
+        cancel_pushes_ = true;
+        limiter_.close();
+
+        // The pushes that were queued in the limiter, or between requests, return at once.
+        // Requests that are already on the wire may still complete.
+        if (!co_await waitForPushes(*timer, clock_t::now() + cancel_grace)) {
+            // Abort the requests on the wire. Their pushes are resumed with an error.
+            LOG_WARN_N << "Aborting the requests of " << active_pushes_.load() << " push(es).";
+            rest_.Close();
+            if (!co_await waitForPushes(*timer, clock_t::now() + cancel_grace)) {
+                LOG_ERROR_N << active_pushes_.load() << " push(es) did not return after the HTTP client was closed.";
+            }
+        }
+    }
+
+    {
+        std::lock_guard lock{mutex_};
+        drain_waiter_.reset();
+    }
+
     rest_.Close();
     setState(State::STOPPED);
-    LOG_INFO_N << "Done.";
+}
+
+boost::asio::awaitable<bool> GooglePusher::waitForPushes(boost::asio::steady_timer& timer,
+                                                        boost::asio::steady_timer::time_point deadline)
+{
+    while(true) {
+        // Re-arm before checking, so a wakeup from ActivePush is not lost
+        timer.expires_at(deadline);
+        if (active_pushes_.load() == 0) {
+            co_return true;
+        }
+        if (boost::asio::steady_timer::clock_type::now() >= deadline) {
+            co_return false;
+        }
+
+        boost::system::error_code ec;
+        co_await timer.async_wait(boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+    }
+}
+
+void GooglePusher::warmup()
+{
+    const auto url = config_.google.fcm_url + "/";
+    LOG_DEBUG_N << "Opening " << config_.google.warmup_connections
+                << " connections to " << url;
+
+    // Start all the requests at once. If we wait for each to finish,
+    // curl will just re-use the first connection.
+    for(auto i = 0u; i < config_.google.warmup_connections; ++i) {
+        boost::asio::co_spawn(ctx_, [this, url]() -> boost::asio::awaitable<void> {
+            try {
+                // The HTTP status is irrelevant. The point is to have curl resolve
+                // the host and keep an open connection in its connection cache.
+                const auto res = co_await rest_.Build()->Head(url)
+                    .Option(CURLOPT_TCP_KEEPALIVE, 1L)
+                    .AsioAsyncExecute(boost::asio::use_awaitable);
+                LOG_TRACE_N << "Warm-up request to " << url
+                            << " completed with HTTP status " << res.http_response_code;
+            } catch (const std::exception& e) {
+                LOG_DEBUG_N << "Warm-up request to " << url << " failed: " << e.what();
+            }
+        }, boost::asio::detached);
+    }
 }
 
 std::string GooglePusher::createJwtToken() const
@@ -329,6 +713,10 @@ void GooglePusher::loadServiceAccount()
 }
 
 std::shared_ptr<Pusher> createPusherForGoogle(const Config& config, boost::asio::io_context& ctx) {
+    if (config.google.shards > 1) {
+        return std::make_shared<ShardedPusher>(config, config.google.shards);
+    }
+
     auto p = std::make_shared<GooglePusher>(config, ctx);
     p->run();
     return p;
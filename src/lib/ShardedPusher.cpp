@@ -0,0 +1,295 @@
+
+#include <atomic>
+#include <cassert>
+
+#include "cpp-push/ShardedPusher.h"
+#include "cpp-push/logging.h"
+#include "AsioHelpers.h"
+
+using namespace std;
+
+namespace jgaa::cpp_push {
+
+namespace {
+
+// Jump consistent hash (Lamping & Veach). Only 1/n of the keys move when a shard is added.
+size_t jumpHash(uint64_t key, size_t buckets) noexcept {
+    int64_t b = -1, j = 0;
+    while(j < static_cast<int64_t>(buckets)) {
+        b = j;
+        key = key * 2862933555777941757ULL + 1;
+        j = static_cast<int64_t>((b + 1) * (static_cast<double>(1LL << 31) / static_cast<double>((key >> 33) + 1)));
+    }
+    return static_cast<size_t>(b);
+}
+
+// FNV-1a. Unlike std::hash, the result is the same for all builds and platforms.
+uint64_t fnv1a(string_view value) noexcept {
+    uint64_t hash = 14695981039346656037ULL;
+    for(const auto ch : value) {
+        hash ^= static_cast<unsigned char>(ch);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+} // anon ns
+
+class ShardedPusher::ActiveFanOut {
+public:
+    explicit ActiveFanOut(ShardedPusher& pusher)
+        : pusher_{pusher} {
+        lock_guard lock{pusher_.mutex_};
+        accepted_ = !pusher_.stopped_;
+        if (accepted_) {
+            ++pusher_.active_fanouts_;
+        }
+    }
+
+    ActiveFanOut(const ActiveFanOut&) = delete;
+    ActiveFanOut& operator = (const ActiveFanOut&) = delete;
+
+    ~ActiveFanOut() {
+        if (accepted_) {
+            lock_guard lock{pusher_.mutex_};
+            if (--pusher_.active_fanouts_ == 0 && pusher_.stopped_) {
+                pusher_.releaseWorkLocked();
+            }
+        }
+    }
+
+    /*! False if the pusher is stopped. The shard threads may then be gone, so don't hand them any work. */
+    [[nodiscard]] bool accepted() const noexcept {
+        return accepted_;
+    }
+
+private:
+    ShardedPusher& pusher_;
+    bool accepted_{false};
+};
+
+ShardedPusher::Shard::Shard(const Config &config, shared_ptr<Tracer> tracer)
+    : pusher{make_unique<GooglePusher>(config, ctx, std::move(tracer))}
+    , work{ctx.get_executor()}
+{
+}
+
+ShardedPusher::ShardedPusher(const Config &config, unsigned shards)
+    : tracer_{make_shared<Tracer>(config.tracing)}
+{
+    assert(shards > 0);
+    LOG_INFO_N << "Starting " << shards << " shards.";
+
+    shards_.reserve(shards);
+    for(auto i = 0u; i < shards; ++i) {
+        shards_.emplace_back(make_unique<Shard>(config, tracer_));
+    }
+
+    auto& leader = *shards_.front()->pusher;
+    leader.run();
+    for(auto i = 1u; i < shards_.size(); ++i) {
+        shards_[i]->pusher->follow(leader);
+    }
+
+    for(auto& shard : shards_) {
+        shard->thread = jthread([&ctx = shard->ctx] {
+            ctx.run();
+        });
+    }
+}
+
+ShardedPusher::~ShardedPusher()
+{
+    stop();
+    // The Shard destructors join the threads
+}
+
+bool ShardedPusher::isReady() const noexcept
+{
+    return shards_.front()->pusher->isReady();
+}
+
+boost::asio::awaitable<bool> ShardedPusher::waitReady(std::chrono::steady_clock::duration timeout)
+{
+    co_return co_await shards_.front()->pusher->waitReady(timeout);
+}
+
+boost::asio::awaitable<Pusher::Result> ShardedPusher::push(const PushMessage &pm)
+{
+    co_return co_await gpush(GooglePusher::toGooglePushMessage(pm));
+}
+
+// Runs start(pusher, slot) on the shard in used[slot] for each slot, and combines the results
+template <typename StartFn>
+boost::asio::awaitable<Pusher::Result> ShardedPusher::fanOut(const vector<size_t>& used, StartFn start)
+{
+    if (used.empty()) {
+        co_return Result{0u};
+    }
+
+    if (used.size() == 1) {
+        auto& shard = *shards_[used.front()];
+        co_return co_await boost::asio::co_spawn(shard.ctx, start(*shard.pusher, 0),
+                                                 boost::asio::use_awaitable);
+    }
+
+    struct Pending {
+        Pending(boost::asio::any_io_executor ex, size_t count)
+            : remaining{count}, results(count), done{std::move(ex), boost::asio::steady_timer::time_point::max()} {}
+
+        atomic_size_t remaining;
+        vector<Result> results;
+        boost::asio::steady_timer done;
+    };
+
+    auto pending = make_shared<Pending>(co_await boost::asio::this_coro::executor, used.size());
+
+    for(size_t slot = 0; slot < used.size(); ++slot) {
+        auto& shard = *shards_[used[slot]];
+        boost::asio::co_spawn(shard.ctx, start(*shard.pusher, slot),
+                              [pending, slot](exception_ptr ex, Result result) {
+            if (ex) {
+                try {
+                    rethrow_exception(ex);
+                } catch (const exception& e) {
+                    result = Result{false, e.what(), 0};
+                }
+            }
+
+            pending->results[slot] = std::move(result);
+            if (pending->remaining.fetch_sub(1, memory_order_acq_rel) == 1) {
+                wakeTimer(pending, pending->done);
+            }
+        });
+    }
+
+    boost::system::error_code ec;
+    co_await pending->done.async_wait(boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+    assert(pending->remaining.load(memory_order_acquire) == 0);
+
+    auto num_successful = 0u;
+    auto error = Result::Error::NONE;
+    string message;
+    vector<string> unsent;
+    for(const auto& result : pending->results) {
+        num_successful += result.numSuccessfulPushes();
+        unsent.insert(unsent.end(), result.unsent().begin(), result.unsent().end());
+        if (!result.ok()) {
+            if (error == Result::Error::NONE) {
+                error = result.error() == Result::Error::NONE ? Result::Error::SEND_FAILED : result.error();
+            }
+            if (!message.empty()) {
+                message += "; ";
+            }
+            message += result.message();
+        }
+    }
+
+    if (error == Result::Error::NONE) {
+        co_return Result{num_successful};
+    }
+
+    co_return Result{error, message, num_successful, std::move(unsent)};
+}
+
+boost::asio::awaitable<Pusher::Result> ShardedPusher::gpush(const GooglePusher::GooglePushMessage &pm)
+{
+    const ActiveFanOut active{*this};
+    if (!active.accepted()) {
+        vector<string> unsent;
+        for(const auto token : PushMessage::tokens_view{pm.to}) {
+            unsent.emplace_back(token);
+        }
+        co_return Result{Result::Error::SHUTTING_DOWN, "The pusher is shutting down", 0, std::move(unsent)};
+    }
+
+    const auto num_shards = shards_.size();
+
+    vector<vector<string_view>> tokens(num_shards);
+    for(const auto token : PushMessage::tokens_view{pm.to}) {
+        tokens[shardFor(token)].push_back(token);
+    }
+
+    // One message per shard that has tokens. The shards refer to these while they work.
+    vector<GooglePusher::GooglePushMessage> messages;
+    vector<size_t> used;
+    messages.reserve(num_shards);
+    for(size_t i = 0; i < num_shards; ++i) {
+        if (!tokens[i].empty()) {
+            auto& msg = messages.emplace_back(pm);
+            msg.to = span{tokens[i]};
+            used.push_back(i);
+        }
+    }
+
+    co_return co_await fanOut(used, [&messages](GooglePusher& pusher, size_t slot) {
+        return pusher.gpush(messages[slot]);
+    });
+}
+
+boost::asio::awaitable<Pusher::Result> ShardedPusher::gpush(const GooglePusher::GooglePushMessage &pm,
+                                                            const TemplateCatalog &catalog,
+                                                            string_view template_id,
+                                                            span<const GooglePusher::Recipient> recipients)
+{
+    const ActiveFanOut active{*this};
+    if (!active.accepted()) {
+        vector<string> unsent;
+        for(const auto& recipient : recipients) {
+            unsent.emplace_back(recipient.token);
+        }
+        co_return Result{Result::Error::SHUTTING_DOWN, "The pusher is shutting down", 0, std::move(unsent)};
+    }
+
+    vector<vector<GooglePusher::Recipient>> per_shard(shards_.size());
+    for(const auto& recipient : recipients) {
+        per_shard[shardFor(recipient.token)].push_back(recipient);
+    }
+
+    vector<size_t> used;
+    for(size_t i = 0; i < per_shard.size(); ++i) {
+        if (!per_shard[i].empty()) {
+            used.push_back(i);
+        }
+    }
+
+    co_return co_await fanOut(used, [&](GooglePusher& pusher, size_t slot) {
+        return pusher.gpush(pm, catalog, template_id, span<const GooglePusher::Recipient>{per_shard[used[slot]]});
+    });
+}
+
+void ShardedPusher::stop()
+{
+    lock_guard lock{mutex_};
+    if (stopped_) {
+        return;
+    }
+    stopped_ = true;
+
+    // The pushers' timers are not thread-safe, so stop each one from its own thread.
+    // The posted handler keeps the shard's io_context running even if we release the work guard.
+    for(auto& shard : shards_) {
+        boost::asio::post(shard->ctx, [pusher = shard->pusher.get()] {
+            pusher->stop();
+        });
+    }
+
+    // Fan-outs in progress may still spawn work on the shards. The last one releases the work guards.
+    if (active_fanouts_ == 0) {
+        releaseWorkLocked();
+    }
+}
+
+void ShardedPusher::releaseWorkLocked()
+{
+    for(auto& shard : shards_) {
+        shard->work.reset();
+    }
+}
+
+size_t ShardedPusher::shardFor(string_view token) const noexcept
+{
+    return jumpHash(fnv1a(token), shards_.size());
+}
+
+} // ns
@@ -0,0 +1,150 @@
+
+#include <stdexcept>
+
+#include "cpp-push/Template.h"
+#include "FcmMessageWriter.h"
+
+using namespace std;
+
+namespace jgaa::cpp_push {
+
+Template::Template(string_view text)
+{
+    auto addLiteral = [this](char ch) {
+        if (segments_.empty() || segments_.back().is_var) {
+            segments_.push_back({false,
+                                 static_cast<uint32_t>(literals_.size()), 0,
+                                 static_cast<uint32_t>(json_literals_.size()), 0});
+        }
+        auto& seg = segments_.back();
+        literals_ += ch;
+        ++seg.size;
+        const auto json_size = json_literals_.size();
+        FcmMessageWriter::appendEscaped(json_literals_, {&ch, 1});
+        seg.json_size += static_cast<uint32_t>(json_literals_.size() - json_size);
+    };
+
+    for(size_t i = 0; i < text.size(); ++i) {
+        const auto ch = text[i];
+        if (ch == '{') {
+            if (i + 1 < text.size() && text[i + 1] == '{') {
+                addLiteral('{');
+                ++i;
+                continue;
+            }
+
+            const auto end = text.find('}', i + 1);
+            if (end == string_view::npos) {
+                throw invalid_argument{"Unterminated placeholder in template"};
+            }
+
+            const auto name = text.substr(i + 1, end - i - 1);
+            if (name.empty() || name.find('{') != string_view::npos) {
+                throw invalid_argument{"Invalid placeholder in template"};
+            }
+
+            segments_.push_back({true,
+                                 static_cast<uint32_t>(names_.size()),
+                                 static_cast<uint32_t>(name.size())});
+            names_ += name;
+            ++num_vars_;
+            i = end;
+            continue;
+        }
+
+        if (ch == '}') {
+            if (i + 1 < text.size() && text[i + 1] == '}') {
+                addLiteral('}');
+                ++i;
+                continue;
+            }
+            throw invalid_argument{"Unmatched '}' in template"};
+        }
+
+        addLiteral(ch);
+    }
+}
+
+string Template::render(vars_t vars) const
+{
+    string out;
+    for(const auto& seg : segments_) {
+        if (seg.is_var) {
+            out += lookup(string_view{names_}.substr(seg.offset, seg.size), vars);
+        } else {
+            out.append(literals_, seg.offset, seg.size);
+        }
+    }
+    return out;
+}
+
+void Template::appendJson(string &out, vars_t vars) const
+{
+    for(const auto& seg : segments_) {
+        if (seg.is_var) {
+            FcmMessageWriter::appendEscaped(out, lookup(string_view{names_}.substr(seg.offset, seg.size), vars));
+        } else {
+            out.append(json_literals_, seg.json_offset, seg.json_size);
+        }
+    }
+}
+
+string_view Template::lookup(string_view name, vars_t vars) noexcept
+{
+    for(const auto& [key, value] : vars) {
+        if (key == name) {
+            return value;
+        }
+    }
+    return {};
+}
+
+void TemplateCatalog::add(string_view id, string_view locale, string_view title, string_view body)
+{
+    NotificationTemplate nt;
+    if (!title.empty()) {
+        nt.title.emplace(title);
+    }
+    if (!body.empty()) {
+        nt.body.emplace(body);
+    }
+
+    auto it = templates_.find(id);
+    if (it == templates_.end()) {
+        it = templates_.emplace(string{id}, locales_t{}).first;
+    }
+
+    it->second.insert_or_assign(string{locale}, std::move(nt));
+}
+
+const NotificationTemplate *TemplateCatalog::find(string_view id, string_view locale) const noexcept
+{
+    const auto it = templates_.find(id);
+    if (it == templates_.end()) {
+        return {};
+    }
+
+    const auto& locales = it->second;
+    auto lookup = [&locales](string_view name) -> const NotificationTemplate * {
+        if (const auto lit = locales.find(name); lit != locales.end()) {
+            return &lit->second;
+        }
+        return {};
+    };
+
+    if (!locale.empty()) {
+        if (const auto *nt = lookup(locale)) {
+            return nt;
+        }
+
+        if (const auto pos = locale.find_first_of("-_"); pos != string_view::npos) {
+            if (const auto *nt = lookup(locale.substr(0, pos))) {
+                return nt;
+            }
+        }
+    }
+
+    return lookup(default_locale_);
+}
+
+} // ns
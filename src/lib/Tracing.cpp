@@ -0,0 +1,201 @@
+
+#include <cassert>
+#include <cstring>
+#include <random>
+
+#include "cpp-push/Tracing.h"
+#include "cpp-push/logging.h"
+#include "FcmMessageWriter.h"
+
+using namespace std;
+
+namespace jgaa::cpp_push {
+
+namespace {
+
+mt19937_64& rng() {
+    thread_local mt19937_64 generator{random_device{}()};
+    return generator;
+}
+
+template <size_t N>
+void randomId(array<uint8_t, N>& id) {
+    for(size_t i = 0; i < N; i += sizeof(uint64_t)) {
+        const auto value = rng()();
+        memcpy(id.data() + i, &value, min(sizeof(value), N - i));
+    }
+}
+
+template <size_t N>
+void appendHex(string& out, const array<uint8_t, N>& id) {
+    static constexpr char hex[] = "0123456789abcdef";
+    for(const auto b : id) {
+        out += hex[b >> 4];
+        out += hex[b & 0x0f];
+    }
+}
+
+void appendString(string& out, string_view value) {
+    out += '"';
+    FcmMessageWriter::appendEscaped(out, value);
+    out += '"';
+}
+
+} // anon ns
+
+Trace::Trace(Tracer &tracer, string_view name)
+    : tracer_{tracer}
+{
+    randomId(trace_id_);
+    spans_.reserve(8);
+    startSpan(name);
+}
+
+Trace::~Trace()
+{
+    endSpan(root);
+    tracer_.exportTrace(*this);
+}
+
+size_t Trace::startSpan(string_view name, size_t parent)
+{
+    auto& span = spans_.emplace_back();
+    span.name = name;
+    span.parent = parent;
+    span.start = clock_t::now();
+    randomId(span.id);
+    return spans_.size() - 1;
+}
+
+void Trace::endSpan(size_t span)
+{
+    assert(span < spans_.size());
+    spans_[span].end = clock_t::now();
+}
+
+void Trace::setAttribute(size_t span, string_view key, attribute_value_t value)
+{
+    assert(span < spans_.size());
+    spans_[span].attributes.emplace_back(key, std::move(value));
+}
+
+void Trace::setError(size_t span)
+{
+    assert(span < spans_.size());
+    spans_[span].error = true;
+}
+
+string Trace::toOtlpJson() const
+{
+    string out;
+    out.reserve(256 + spans_.size() * 256);
+
+    out.append(R"({"resourceSpans":[{"resource":{"attributes":[{"key":"service.name","value":{"stringValue":"cpp-push"}}]},)"
+               R"("scopeSpans":[{"scope":{"name":"cpp-push","version":")" CPP_PUSH_VERSION R"("},"spans":[)");
+
+    for(size_t i = 0; i < spans_.size(); ++i) {
+        const auto& span = spans_[i];
+        if (i) {
+            out += ',';
+        }
+
+        out.append(R"({"traceId":")");
+        appendHex(out, trace_id_);
+        out.append(R"(","spanId":")");
+        appendHex(out, span.id);
+        out += '"';
+        if (i != root) {
+            out.append(R"(,"parentSpanId":")");
+            appendHex(out, spans_.at(span.parent).id);
+            out += '"';
+        }
+        out.append(R"(,"name":)");
+        appendString(out, span.name);
+        // OTLP/JSON encodes 64 bit integers as strings
+        out.append(format(R"(,"kind":{},"startTimeUnixNano":"{}","endTimeUnixNano":"{}","attributes":[)",
+                          i == root ? 3 /* CLIENT */ : 1 /* INTERNAL */,
+                          tracer_.toUnixNano(span.start),
+                          tracer_.toUnixNano(span.end)));
+
+        for(size_t a = 0; a < span.attributes.size(); ++a) {
+            const auto& [key, value] = span.attributes[a];
+            if (a) {
+                out += ',';
+            }
+            out.append(R"({"key":)");
+            appendString(out, key);
+            out.append(R"(,"value":{)");
+            if (const auto *str = get_if<string>(&value)) {
+                out.append(R"("stringValue":)");
+                appendString(out, *str);
+            } else {
+                out.append(format(R"("intValue":"{}")", get<int64_t>(value)));
+            }
+            out.append("}}");
+        }
+
+        // 1 = STATUS_CODE_OK, 2 = STATUS_CODE_ERROR
+        out.append(format(R"(],"status":{{"code":{}}}}})", span.error ? 2 : 1));
+    }
+
+    out.append("]}]}]}");
+    return out;
+}
+
+Tracer::Tracer(const Config::Tracing &config)
+    : config_{config}
+{
+    if (config_.sample_rate > 0.0 && !config_.file.empty()) {
+        file_.open(config_.file, ios::app);
+        if (!file_) {
+            string_view reason = std::strerror(errno);
+            LOG_ERROR_N << "Failed to open trace file " << config_.file << ": " << reason;
+            throw runtime_error{"Failed to open trace file"};
+        }
+        LOG_INFO_N << "Writing traces to " << config_.file
+                   << " with sample rate " << config_.sample_rate;
+    }
+}
+
+unique_ptr<Trace> Tracer::startTrace(string_view name)
+{
+    if (!enabled()) {
+        return {};
+    }
+
+    if (config_.sample_rate < 1.0) {
+        if (uniform_real_distribution<double>{0.0, 1.0}(rng()) >= config_.sample_rate) {
+            return {};
+        }
+    }
+
+    return make_unique<Trace>(*this, name);
+}
+
+uint64_t Tracer::toUnixNano(Trace::clock_t::time_point when) const noexcept
+{
+    using namespace std::chrono;
+    const auto since_epoch = duration_cast<nanoseconds>(system_anchor_.time_since_epoch())
+                             + duration_cast<nanoseconds>(when - steady_anchor_);
+    return static_cast<uint64_t>(since_epoch.count());
+}
+
+void Tracer::exportTrace(const Trace &trace) noexcept
+{
+    try {
+        if (file_.is_open()) {
+            const auto json = trace.toOtlpJson();
+            lock_guard lock{mutex_};
+            file_ << json << '\n';
+            file_.flush(); // Don't lose traces if we crash
+        }
+
+        if (config_.callback) {
+            config_.callback(trace);
+        }
+    } catch (const exception& e) {
+        LOG_WARN_N << "Failed to export trace: " << e.what();
+    }
+}
+
+} // ns
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+
+namespace jgaa::cpp_push::loadgen {
+
+/*! Latency histogram with constant memory use.
+ *
+ * Values are bucketed by their power of two, and each power of two is split
+ * into 32 linear sub-buckets, so percentiles are accurate to about 3%.
+ */
+class Histogram {
+public:
+    static constexpr unsigned sub_bits = 5;
+    static constexpr unsigned sub_buckets = 1u << sub_bits;
+
+    void add(std::chrono::microseconds value) noexcept {
+        const auto v = static_cast<uint64_t>(std::max<int64_t>(value.count(), 0));
+        ++buckets_[index(v)];
+        ++count_;
+        max_ = std::max(max_, v);
+    }
+
+    void merge(const Histogram& other) noexcept {
+        for(size_t i = 0; i < buckets_.size(); ++i) {
+            buckets_[i] += other.buckets_[i];
+        }
+        count_ += other.count_;
+        max_ = std::max(max_, other.max_);
+    }
+
+    void reset() noexcept {
+        *this = {};
+    }
+
+    [[nodiscard]] uint64_t count() const noexcept {
+        return count_;
+    }
+
+    [[nodiscard]] std::chrono::microseconds max() const noexcept {
+        return std::chrono::microseconds(max_);
+    }
+
+    /*! Value at the given percentile (0 - 100). Returns the upper bound of the bucket. */
+    [[nodiscard]] std::chrono::microseconds percentile(double pct) const noexcept {
+        if (!count_) {
+            return {};
+        }
+
+        const auto wanted = static_cast<uint64_t>(static_cast<double>(count_) * pct / 100.0 + 0.5);
+        uint64_t seen = 0;
+        for(size_t i = 0; i < buckets_.size(); ++i) {
+            seen += buckets_[i];
+            if (seen >= std::max<uint64_t>(wanted, 1)) {
+                return std::chrono::microseconds(std::min(upperBound(i), max_));
+            }
+        }
+        return max();
+    }
+
+private:
+    static size_t index(uint64_t v) noexcept {
+        if (v < sub_buckets) {
+            return static_cast<size_t>(v);
+        }
+        const unsigned shift = static_cast<unsigned>(std::bit_width(v)) - sub_bits - 1;
+        return static_cast<size_t>((shift + 1) * sub_buckets + ((v >> shift) - sub_buckets));
+    }
+
+    static uint64_t upperBound(size_t i) noexcept {
+        if (i < sub_buckets) {
+            return i;
+        }
+        const auto shift = static_cast<unsigned>(i / sub_buckets) - 1;
+        const auto sub = (i % sub_buckets) + sub_buckets;
+        return ((sub + 1) << shift) - 1;
+    }
+
+    std::array<uint64_t, (64 - sub_bits + 1) * sub_buckets> buckets_{};
+    uint64_t count_{};
+    uint64_t max_{};
+};
+
+} // ns
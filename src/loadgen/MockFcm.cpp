@@ -0,0 +1,218 @@
+
+#include <random>
+
+#include <boost/beast/core.hpp>
+
+#include "MockFcm.h"
+#include "cpp-push/logging.h"
+
+namespace http = boost::beast::http;
+using tcp = boost::asio::ip::tcp;
+using namespace std;
+
+namespace jgaa::cpp_push::loadgen {
+
+namespace {
+
+double random01() {
+    thread_local mt19937_64 rng{random_device{}()};
+    return uniform_real_distribution<double>{0.0, 1.0}(rng);
+}
+
+bool chance(double rate) {
+    return rate > 0.0 && random01() < rate;
+}
+
+} // anon ns
+
+MockFcm::MockFcm(const Options &options)
+    : options_{options}
+{
+}
+
+MockFcm::~MockFcm()
+{
+    stop();
+}
+
+void MockFcm::start()
+{
+    const tcp::endpoint ep{boost::asio::ip::make_address(options_.address), options_.port};
+    acceptor_.open(ep.protocol());
+    acceptor_.set_option(boost::asio::socket_base::reuse_address(true));
+    acceptor_.bind(ep);
+    acceptor_.listen();
+    port_ = acceptor_.local_endpoint().port();
+
+    LOG_INFO_N << "Mock FCM listening on " << url();
+
+    boost::asio::co_spawn(ctx_, accept(), boost::asio::detached);
+
+    for(auto i = 0u; i < max(options_.threads, 1u); ++i) {
+        threads_.emplace_back([this] {
+            ctx_.run();
+        });
+    }
+}
+
+void MockFcm::stop()
+{
+    if (!ctx_.stopped()) {
+        ctx_.stop();
+    }
+    threads_.clear(); // joins
+}
+
+string MockFcm::url() const
+{
+    return format("http://{}:{}", options_.address, port_);
+}
+
+MockFcm::Stats MockFcm::stats() const noexcept
+{
+    return {
+        connections_.load(),
+        tokens_issued_.load(),
+        sends_.load(),
+        throttled_.load(),
+        errors_.load(),
+        unauthorized_.load(),
+        disconnects_.load()
+    };
+}
+
+boost::asio::awaitable<void> MockFcm::accept()
+{
+    while(acceptor_.is_open()) {
+        boost::system::error_code ec;
+        auto socket = co_await acceptor_.async_accept(boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+        if (ec) {
+            if (ec == boost::asio::error::operation_aborted) {
+                break;
+            }
+            LOG_WARN_N << "Accept failed: " << ec.message();
+            continue;
+        }
+
+        ++connections_;
+        boost::asio::co_spawn(ctx_, session(std::move(socket)), boost::asio::detached);
+    }
+}
+
+boost::asio::awaitable<void> MockFcm::session(tcp::socket socket)
+{
+    boost::beast::tcp_stream stream{std::move(socket)};
+    boost::beast::flat_buffer buffer;
+    boost::system::error_code ec;
+
+    while(true) {
+        request_t req;
+        co_await http::async_read(stream, buffer, req, boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+        if (ec) {
+            break; // Normally the client closed the connection
+        }
+
+        auto res = co_await handle(req);
+        const bool close = !req.keep_alive() || chance(options_.disconnect_rate);
+        res.keep_alive(!close);
+        res.prepare_payload();
+
+        co_await http::async_write(stream, res, boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+        if (ec || close) {
+            if (close) {
+                ++disconnects_;
+            }
+            break;
+        }
+    }
+
+    stream.socket().shutdown(tcp::socket::shutdown_send, ec);
+}
+
+boost::asio::awaitable<MockFcm::response_t> MockFcm::handle(const request_t &req)
+{
+    const string_view target{req.target().data(), req.target().size()};
+
+    response_t res{http::status::ok, req.version()};
+    res.set(http::field::content_type, "application/json");
+
+    if (req.method() == http::verb::post && target == "/token") {
+        co_return issueToken(req);
+    }
+
+    if (req.method() != http::verb::post || !target.ends_with("/messages:send")) {
+        res.result(http::status::not_found);
+        res.body() = R"({"error":{"code":404,"status":"NOT_FOUND"}})";
+        co_return res;
+    }
+
+    ++sends_;
+
+    if (!isAuthorized(req)) {
+        ++unauthorized_;
+        res.result(http::status::unauthorized);
+        res.body() = R"({"error":{"code":401,"status":"UNAUTHENTICATED"}})";
+        co_return res;
+    }
+
+    if (options_.latency.count() || options_.latency_jitter.count()) {
+        const auto delay = options_.latency
+                           + chrono::duration_cast<chrono::milliseconds>(options_.latency_jitter * random01());
+        boost::asio::steady_timer timer{co_await boost::asio::this_coro::executor, delay};
+        boost::system::error_code ec;
+        co_await timer.async_wait(boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+    }
+
+    const auto r = random01();
+    if (r < options_.throttle_rate) {
+        ++throttled_;
+        res.result(http::status::too_many_requests);
+        res.body() = R"({"error":{"code":429,"status":"RESOURCE_EXHAUSTED"}})";
+    } else if (r < options_.throttle_rate + options_.error_rate) {
+        ++errors_;
+        res.result(http::status::service_unavailable);
+        res.body() = R"({"error":{"code":503,"status":"UNAVAILABLE"}})";
+    } else {
+        res.body() = format(R"({{"name":"projects/loadgen/messages/{}"}})", sends_.load());
+    }
+
+    co_return res;
+}
+
+MockFcm::response_t MockFcm::issueToken(const request_t &req)
+{
+    const auto now = chrono::steady_clock::now();
+    string token;
+    {
+        lock_guard lock{mutex_};
+        erase_if(tokens_, [now](const auto& v) { return v.second < now; });
+        token = format("mock-token-{}", ++next_token_);
+        tokens_.emplace(token, now + options_.token_ttl);
+    }
+    ++tokens_issued_;
+
+    LOG_DEBUG_N << "Issued " << token << ", expires in " << options_.token_ttl.count() << " seconds";
+
+    response_t res{http::status::ok, req.version()};
+    res.set(http::field::content_type, "application/json");
+    res.body() = format(R"({{"access_token":"{}","expires_in":{},"token_type":"Bearer"}})",
+                        token, options_.token_ttl.count());
+    return res;
+}
+
+bool MockFcm::isAuthorized(const request_t &req)
+{
+    constexpr string_view prefix = "Bearer ";
+    const auto header = req[http::field::authorization];
+    const string_view auth{header.data(), header.size()};
+    if (!auth.starts_with(prefix)) {
+        return false;
+    }
+
+    const string token{auth.substr(prefix.size())};
+    lock_guard lock{mutex_};
+    const auto it = tokens_.find(token);
+    return it != tokens_.end() && it->second >= chrono::steady_clock::now();
+}
+
+} // ns
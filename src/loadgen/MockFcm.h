@@ -0,0 +1,91 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/beast/http.hpp>
+
+namespace jgaa::cpp_push::loadgen {
+
+/*! Minimal local stand-in for the Google OAuth token endpoint and the FCM v1 send API.
+ *
+ * Plain HTTP/1.1 with keep-alive. Issues short-lived access tokens, rejects requests
+ * with unknown or expired tokens, and can inject latency, throttling (429), server
+ * errors (503) and dropped connections.
+ */
+class MockFcm {
+public:
+    struct Options {
+        std::string address{"127.0.0.1"};
+        uint16_t port{0}; // 0: pick a free port
+        unsigned threads{2};
+        std::chrono::seconds token_ttl{150};
+        std::chrono::milliseconds latency{5};
+        std::chrono::milliseconds latency_jitter{5};
+        double throttle_rate{0.0}; // Fraction of sends answered with 429
+        double error_rate{0.0}; // Fraction of sends answered with 503
+        double disconnect_rate{0.0}; // Fraction of responses followed by closing the connection
+    };
+
+    struct Stats {
+        uint64_t connections{};
+        uint64_t tokens_issued{};
+        uint64_t sends{};
+        uint64_t throttled{};
+        uint64_t errors{};
+        uint64_t unauthorized{};
+        uint64_t disconnects{};
+    };
+
+    explicit MockFcm(const Options& options);
+    ~MockFcm();
+
+    void start();
+    void stop();
+
+    [[nodiscard]] uint16_t port() const noexcept {
+        return port_;
+    }
+
+    /*! Base URL, like "http://127.0.0.1:12345" */
+    [[nodiscard]] std::string url() const;
+
+    [[nodiscard]] Stats stats() const noexcept;
+
+private:
+    using request_t = boost::beast::http::request<boost::beast::http::string_body>;
+    using response_t = boost::beast::http::response<boost::beast::http::string_body>;
+
+    boost::asio::awaitable<void> accept();
+    boost::asio::awaitable<void> session(boost::asio::ip::tcp::socket socket);
+    boost::asio::awaitable<response_t> handle(const request_t& req);
+    response_t issueToken(const request_t& req);
+    bool isAuthorized(const request_t& req);
+
+    const Options options_;
+    boost::asio::io_context ctx_;
+    boost::asio::ip::tcp::acceptor acceptor_{ctx_};
+    std::vector<std::jthread> threads_;
+    uint16_t port_{};
+
+    std::mutex mutex_;
+    std::unordered_map<std::string, std::chrono::steady_clock::time_point> tokens_;
+    uint64_t next_token_{};
+
+    std::atomic_uint64_t connections_{};
+    std::atomic_uint64_t tokens_issued_{};
+    std::atomic_uint64_t sends_{};
+    std::atomic_uint64_t throttled_{};
+    std::atomic_uint64_t errors_{};
+    std::atomic_uint64_t unauthorized_{};
+    std::atomic_uint64_t disconnects_{};
+};
+
+} // ns
@@ -0,0 +1,658 @@
+
+#include <array>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <random>
+#include <sstream>
+
+#include <unistd.h>
+
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+
+#include <boost/asio.hpp>
+#include <boost/program_options.hpp>
+
+#include "cpp-push/cpp-push.h"
+#include "cpp-push/GooglePusher.h"
+#include "cpp-push/ShardedPusher.h"
+#include "cpp-push/logging.h"
+#include "Histogram.h"
+#include "MockFcm.h"
+
+using namespace jgaa::cpp_push;
+using namespace jgaa::cpp_push::loadgen;
+using namespace std;
+
+namespace {
+
+using steady_clock = chrono::steady_clock;
+
+optional<logfault::LogLevel> toLogLevel(string_view name) {
+    if (name.empty() || name == "off" || name == "false") {
+        return {};
+    }
+
+    if (name == "debug") {
+        return logfault::LogLevel::DEBUGGING;
+    }
+
+    if (name == "trace") {
+        return logfault::LogLevel::TRACE;
+    }
+
+    if (name == "warn") {
+        return logfault::LogLevel::WARN;
+    }
+
+    return logfault::LogLevel::INFO;
+}
+
+struct Options {
+    double rate{500}; // Messages per second
+    int duration{60}; // Seconds
+    unsigned tokens_per_message{1};
+    size_t body_bytes{128};
+    filesystem::path profile;
+    unsigned device_tokens{10000};
+    size_t max_outstanding{10000};
+    int report_interval{10};
+    filesystem::path csv;
+    int drain_timeout{30};
+    double max_failure_rate{1.0};
+    size_t max_rss_growth_mb{0};
+};
+
+/*! One message in the traffic profile */
+struct Event {
+    chrono::microseconds at; // Offset from the start of the run
+    unsigned tokens{1};
+    size_t body_bytes{};
+};
+
+/*! Synthetic traffic at a fixed rate, or a recorded profile that is replayed.
+ *
+ * Profiles are CSV files with lines of `offset_ms,tokens,body_bytes`. Lines starting
+ * with '#' are ignored. The profile is repeated until the duration of the run expires.
+ */
+class Traffic {
+public:
+    explicit Traffic(const Options& options)
+        : options_{options}, duration_{chrono::seconds{options.duration}} {
+        if (!options.profile.empty()) {
+            load(options.profile);
+        }
+    }
+
+    optional<Event> next() {
+        if (profile_.empty()) {
+            const auto at = chrono::microseconds{static_cast<int64_t>(static_cast<double>(seq_++) * 1'000'000.0 / options_.rate)};
+            if (at >= duration_) {
+                return {};
+            }
+            return Event{at, options_.tokens_per_message, options_.body_bytes};
+        }
+
+        if (ix_ == profile_.size()) {
+            ix_ = 0;
+            base_ += profile_length_;
+        }
+
+        auto ev = profile_[ix_++];
+        ev.at += base_;
+        if (ev.at >= duration_) {
+            return {};
+        }
+        return ev;
+    }
+
+private:
+    void load(const filesystem::path& path) {
+        ifstream in{path};
+        if (!in) {
+            throw runtime_error{format("Failed to open the traffic profile {}", path.string())};
+        }
+
+        string line;
+        while(getline(in, line)) {
+            if (line.empty() || line.front() == '#') {
+                continue;
+            }
+            long long offset_ms{};
+            unsigned tokens{};
+            size_t body_bytes{};
+            char c1{}, c2{};
+            istringstream row{line};
+            if (!(row >> offset_ms >> c1 >> tokens >> c2 >> body_bytes) || c1 != ',' || c2 != ',') {
+                throw runtime_error{format("Invalid line in the traffic profile: {}", line)};
+            }
+            profile_.push_back({chrono::milliseconds{offset_ms}, max(tokens, 1u), body_bytes});
+        }
+
+        if (profile_.empty()) {
+            throw runtime_error{"The traffic profile is empty"};
+        }
+
+        // Leave one average interval between the last event and the first event of the next round
+        profile_length_ = profile_.back().at + profile_.back().at / static_cast<int64_t>(profile_.size());
+        profile_length_ = max(profile_length_, chrono::microseconds{1000});
+        LOG_INFO << "Loaded " << profile_.size() << " events from " << path;
+    }
+
+    const Options& options_;
+    const chrono::microseconds duration_;
+    vector<Event> profile_;
+    chrono::microseconds profile_length_{};
+    chrono::microseconds base_{};
+    size_t ix_{};
+    uint64_t seq_{};
+};
+
+// Resident set size in bytes (Linux).
+size_t currentRss() {
+    ifstream statm{"/proc/self/statm"};
+    size_t pages{}, resident{};
+    if (statm >> pages >> resident) {
+        return resident * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    }
+    return 0;
+}
+
+double toMb(size_t bytes) {
+    return static_cast<double>(bytes) / (1024.0 * 1024.0);
+}
+
+double toMs(chrono::microseconds us) {
+    return static_cast<double>(us.count()) / 1000.0;
+}
+
+// The pusher needs a real key to sign its JWT's. The mock does not verify them.
+string createPrivateKey() {
+    unique_ptr<EVP_PKEY_CTX, decltype(&EVP_PKEY_CTX_free)> kctx{EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, nullptr), EVP_PKEY_CTX_free};
+    EVP_PKEY *raw_key = nullptr;
+    if (!kctx || EVP_PKEY_keygen_init(kctx.get()) <= 0
+        || EVP_PKEY_CTX_set_rsa_keygen_bits(kctx.get(), 2048) <= 0
+        || EVP_PKEY_keygen(kctx.get(), &raw_key) <= 0) {
+        throw runtime_error{"Failed to generate a RSA key"};
+    }
+    unique_ptr<EVP_PKEY, decltype(&EVP_PKEY_free)> key{raw_key, EVP_PKEY_free};
+
+    unique_ptr<BIO, decltype(&BIO_free)> bio{BIO_new(BIO_s_mem()), BIO_free};
+    if (!bio || !PEM_write_bio_PrivateKey(bio.get(), key.get(), nullptr, nullptr, 0, nullptr, nullptr)) {
+        throw runtime_error{"Failed to export the RSA key"};
+    }
+
+    char *data = nullptr;
+    const auto len = BIO_get_mem_data(bio.get(), &data);
+    return {data, static_cast<size_t>(len)};
+}
+
+filesystem::path writeServiceAccount(const filesystem::path& dir, const string& token_uri) {
+    string key;
+    for(const auto ch : createPrivateKey()) {
+        if (ch == '\n') {
+            key += "\\n";
+        } else {
+            key += ch;
+        }
+    }
+
+    const auto path = dir / "service-account.json";
+    ofstream out{path};
+    out << "{\n"
+        << R"(  "type": "service_account",)" << '\n'
+        << R"(  "project_id": "loadgen",)" << '\n'
+        << R"(  "private_key_id": "loadgen-key",)" << '\n'
+        << R"(  "private_key": ")" << key << "\",\n"
+        << R"(  "client_email": "loadgen@loadgen.iam.gserviceaccount.com",)" << '\n'
+        << R"(  "client_id": "1",)" << '\n'
+        << R"(  "auth_uri": "http://127.0.0.1/auth",)" << '\n'
+        << R"(  "token_uri": ")" << token_uri << "\"\n"
+        << "}\n";
+
+    if (!out) {
+        throw runtime_error{format("Failed to write {}", path.string())};
+    }
+
+    return path;
+}
+
+/*! Drives the traffic through the pusher and collects the statistics.
+ *
+ * Everything here runs on the io_context of the pusher's caller, which is run by one thread.
+ */
+class LoadRun {
+public:
+    LoadRun(boost::asio::io_context& ctx, Pusher& pusher, const Options& options, MockFcm& mock)
+        : ctx_{ctx}, pusher_{pusher}, options_{options}, traffic_{options}, mock_{mock} {
+
+        device_tokens_.reserve(options.device_tokens);
+        for(auto i = 0u; i < max(options.device_tokens, 1u); ++i) {
+            // Real FCM tokens are about 150 characters
+            auto token = "loadgen-device-" + to_string(i) + '-';
+            token.resize(152, 'x');
+            device_tokens_.emplace_back(std::move(token));
+        }
+
+        if (!options.csv.empty()) {
+            csv_.open(options.csv);
+            if (!csv_) {
+                throw runtime_error{format("Failed to open {}", options.csv.string())};
+            }
+            csv_ << "elapsed_sec,rss_bytes,messages,ok,failed,skipped,p50_us,p90_us,p99_us,p999_us,max_us,"
+                    "in_flight,concurrency_limit,tokens_issued\n";
+        }
+    }
+
+    boost::asio::awaitable<void> drive() {
+        if (!co_await pusher_.waitReady(chrono::seconds{30})) {
+            LOG_ERROR << "The pusher did not become ready.";
+            failed_to_start_ = true;
+            finish();
+            co_return;
+        }
+
+        start_ = last_report_ = steady_clock::now();
+        rss_start_ = rss_peak_ = currentRss();
+        boost::asio::co_spawn(ctx_, report(), boost::asio::detached);
+
+        boost::asio::steady_timer timer{ctx_};
+        while(auto ev = traffic_.next()) {
+            if (const auto when = start_ + ev->at; when > steady_clock::now()) {
+                timer.expires_at(when);
+                co_await timer.async_wait(boost::asio::use_awaitable);
+            }
+
+            if (live_ >= options_.max_outstanding) {
+                ++skipped_;
+                continue;
+            }
+
+            boost::asio::co_spawn(ctx_, pushOne(*ev, ++seq_), boost::asio::detached);
+        }
+
+        generation_done_ = steady_clock::now();
+        LOG_INFO << "Done generating traffic. Waiting for " << live_ << " pushes to complete.";
+
+        const auto deadline = steady_clock::now() + chrono::seconds{options_.drain_timeout};
+        while(live_ > 0 && steady_clock::now() < deadline) {
+            timer.expires_after(chrono::milliseconds{10});
+            co_await timer.async_wait(boost::asio::use_awaitable);
+        }
+
+        leaked_ = live_;
+        finish();
+    }
+
+    [[nodiscard]] bool done() const noexcept {
+        return done_at_.has_value();
+    }
+
+    [[nodiscard]] steady_clock::time_point doneAt() const noexcept {
+        return *done_at_;
+    }
+
+    void shutdownTimedOut() noexcept {
+        shutdown_timed_out_ = true;
+    }
+
+    /*! Print the summary.
+     * @return The exit code for the process.
+     */
+    int summary() {
+        const auto ms = mock_.stats();
+        const auto elapsed = chrono::duration<double>(generation_done_ - start_).count();
+        const auto total = ok_ + failed_;
+        const auto rss_end = currentRss();
+        const auto rss_growth = rss_end > rss_start_ ? rss_end - rss_start_ : 0;
+
+        cout << "\n===== Summary =====\n"
+             << format("Messages:      {} ok, {} failed, {} skipped (too many outstanding)\n", ok_, failed_, skipped_)
+             << format("Device pushes: {}\n", successful_pushes_)
+             << format("Throughput:    {:.1f} msgs/s over {:.1f} seconds\n", elapsed > 0 ? ok_ / elapsed : 0.0, elapsed)
+             << format("Latency (ms):  p50={:.2f} p90={:.2f} p99={:.2f} p99.9={:.2f} max={:.2f}\n",
+                       toMs(total_latency_.percentile(50)), toMs(total_latency_.percentile(90)),
+                       toMs(total_latency_.percentile(99)), toMs(total_latency_.percentile(99.9)),
+                       toMs(total_latency_.max()))
+             << format("RSS (MiB):     start={:.1f} peak={:.1f} end={:.1f} growth={:.1f}\n",
+                       toMb(rss_start_), toMb(rss_peak_), toMb(rss_end), toMb(rss_growth))
+             << format("Mock:          {} connections, {} tokens issued, {} sends, {} throttled, {} errors, "
+                       "{} unauthorized, {} disconnects\n",
+                       ms.connections, ms.tokens_issued, ms.sends, ms.throttled, ms.errors,
+                       ms.unauthorized, ms.disconnects)
+             << format("Leaked coroutine frames: {}\n", leaked_)
+             << format("Shutdown:      {}\n", shutdown_timed_out_ ? "TIMED OUT" : "clean");
+
+        int rval = 0;
+        auto fail = [&rval](string_view why) {
+            cout << "FAIL: " << why << '\n';
+            rval = 1;
+        };
+
+        if (failed_to_start_) {
+            fail("The pusher never became ready");
+        }
+        if (leaked_) {
+            fail("Pushes did not complete");
+        }
+        if (shutdown_timed_out_) {
+            fail("The pusher did not shut down");
+        }
+        if (total && static_cast<double>(failed_) / static_cast<double>(total) > options_.max_failure_rate) {
+            fail("Too many failed messages");
+        }
+        if (options_.max_rss_growth_mb && toMb(rss_growth) > static_cast<double>(options_.max_rss_growth_mb)) {
+            fail("RSS grew too much");
+        }
+        if (!rval) {
+            cout << "PASS\n";
+        }
+
+        return rval;
+    }
+
+private:
+    boost::asio::awaitable<void> pushOne(Event ev, uint64_t seq) {
+        ++live_;
+        // Also count down if the coroutine is destroyed without completing
+        struct Live {
+            ~Live() { --live; }
+            size_t& live;
+        } live_guard{live_};
+
+        vector<string_view> tokens;
+        tokens.reserve(ev.tokens);
+        uniform_int_distribution<size_t> pick{0, device_tokens_.size() - 1};
+        for(auto i = 0u; i < ev.tokens; ++i) {
+            tokens.emplace_back(device_tokens_[pick(rng_)]);
+        }
+
+        const auto seq_str = to_string(seq);
+        const string body(ev.body_bytes, 'x');
+        array<pair<string_view, string_view>, 2> data{{{"seq", seq_str}, {"body", body}}};
+
+        PushMessage pm;
+        if (tokens.size() == 1) {
+            pm.to = tokens.front();
+        } else {
+            pm.to = span{tokens};
+        }
+        pm.data = data;
+
+        const auto started = steady_clock::now();
+        bool ok = false;
+        try {
+            const auto res = co_await pusher_.push(pm);
+            ok = res.ok();
+            successful_pushes_ += res.numSuccessfulPushes();
+        } catch (const exception& e) {
+            LOG_WARN << "Push #" << seq << " threw: " << e.what();
+        }
+
+        const auto latency = chrono::duration_cast<chrono::microseconds>(steady_clock::now() - started);
+        interval_latency_.add(latency);
+        total_latency_.add(latency);
+        ++(ok ? ok_ : failed_);
+    }
+
+    boost::asio::awaitable<void> report() {
+        while(!done()) {
+            report_timer_.expires_after(chrono::seconds{max(options_.report_interval, 1)});
+            boost::system::error_code ec;
+            co_await report_timer_.async_wait(boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+            if (!done()) {
+                printReport();
+            }
+        }
+    }
+
+    unsigned concurrencyLimit() {
+        if (auto *gp = dynamic_cast<GooglePusher *>(&pusher_)) {
+            return gp->concurrency().limit;
+        }
+        if (auto *sp = dynamic_cast<ShardedPusher *>(&pusher_)) {
+            unsigned limit = 0;
+            for(size_t i = 0; i < sp->numShards(); ++i) {
+                limit += sp->shard(i).concurrency().limit;
+            }
+            return limit;
+        }
+        return 0;
+    }
+
+    void printReport() {
+        const auto now = steady_clock::now();
+        const auto elapsed = chrono::duration_cast<chrono::seconds>(now - start_).count();
+        const auto interval = chrono::duration<double>(now - last_report_).count();
+        const auto rss = currentRss();
+        const auto messages = interval_latency_.count();
+        const auto limit = concurrencyLimit();
+        const auto tokens_issued = mock_.stats().tokens_issued;
+        rss_peak_ = max(rss_peak_, rss);
+
+        LOG_INFO << format("[{:>5}s] rss={:.1f}MiB msgs={} ({:.0f}/s) ok={} failed={} skipped={} "
+                           "p50={:.2f}ms p90={:.2f}ms p99={:.2f}ms p99.9={:.2f}ms in-flight={} limit={} oauth-tokens={}",
+                           elapsed, toMb(rss), messages, interval > 0 ? messages / interval : 0.0,
+                           ok_, failed_, skipped_,
+                           toMs(interval_latency_.percentile(50)), toMs(interval_latency_.percentile(90)),
+                           toMs(interval_latency_.percentile(99)), toMs(interval_latency_.percentile(99.9)),
+                           live_, limit, tokens_issued);
+
+        if (csv_.is_open()) {
+            csv_ << elapsed << ',' << rss << ',' << messages << ',' << ok_ << ',' << failed_ << ',' << skipped_ << ','
+                 << interval_latency_.percentile(50).count() << ',' << interval_latency_.percentile(90).count() << ','
+                 << interval_latency_.percentile(99).count() << ',' << interval_latency_.percentile(99.9).count() << ','
+                 << interval_latency_.max().count() << ',' << live_ << ',' << limit << ',' << tokens_issued << '\n';
+            csv_.flush();
+        }
+
+        interval_latency_.reset();
+        last_report_ = now;
+    }
+
+    void finish() {
+        pusher_.stop();
+        done_at_ = steady_clock::now();
+
+        // Don't keep the io_context busy until the next report
+        report_timer_.cancel();
+    }
+
+    boost::asio::io_context& ctx_;
+    Pusher& pusher_;
+    const Options& options_;
+    Traffic traffic_;
+    MockFcm& mock_;
+    vector<string> device_tokens_;
+    mt19937_64 rng_{random_device{}()};
+    ofstream csv_;
+    boost::asio::steady_timer report_timer_{ctx_};
+
+    steady_clock::time_point start_;
+    steady_clock::time_point last_report_;
+    steady_clock::time_point generation_done_;
+    optional<steady_clock::time_point> done_at_;
+    uint64_t seq_{};
+    size_t live_{};
+    size_t leaked_{};
+    uint64_t ok_{};
+    uint64_t failed_{};
+    uint64_t skipped_{};
+    uint64_t successful_pushes_{};
+    size_t rss_start_{};
+    size_t rss_peak_{};
+    Histogram interval_latency_;
+    Histogram total_latency_;
+    bool failed_to_start_{false};
+    bool shutdown_timed_out_{false};
+};
+
+} // anon ns
+
+int main(int argc, char* argv[]) {
+    Config config;
+    Options options;
+    MockFcm::Options mock_options;
+    string log_level_console = "info";
+    int token_ttl = static_cast<int>(mock_options.token_ttl.count());
+    int latency_ms = static_cast<int>(mock_options.latency.count());
+    int latency_jitter_ms = static_cast<int>(mock_options.latency_jitter.count());
+
+    config.google.jwt_refresh_minutes = 1;
+
+    namespace po = boost::program_options;
+    po::options_description general("General");
+    general.add_options()
+        ("help,h", "Show help message")
+        ("log-to-console,C",
+         po::value(&log_level_console)->default_value(log_level_console),
+         "Log-level to the console; one of 'warn', 'info', 'debug', 'trace'. Empty string to disable.")
+        ("csv", po::value(&options.csv),
+         "Write the periodic reports to this CSV file")
+        ("report-interval", po::value(&options.report_interval)->default_value(options.report_interval),
+         "Seconds between the periodic reports");
+
+    po::options_description traffic("Traffic");
+    traffic.add_options()
+        ("rate,r", po::value(&options.rate)->default_value(options.rate),
+         "Messages per second for synthetic traffic")
+        ("duration,d", po::value(&options.duration)->default_value(options.duration),
+         "Duration of the run in seconds")
+        ("tokens-per-message", po::value(&options.tokens_per_message)->default_value(options.tokens_per_message),
+         "Device tokens per message for synthetic traffic")
+        ("body-bytes", po::value(&options.body_bytes)->default_value(options.body_bytes),
+         "Size of the data payload for synthetic traffic")
+        ("profile,p", po::value(&options.profile),
+         "Replay this traffic profile instead of synthetic traffic. CSV with lines of 'offset_ms,tokens,body_bytes'. "
+         "The profile is repeated until the duration expires.")
+        ("device-tokens", po::value(&options.device_tokens)->default_value(options.device_tokens),
+         "Number of distinct device tokens to send to")
+        ("max-outstanding", po::value(&options.max_outstanding)->default_value(options.max_outstanding),
+         "Max number of push operations in progress. Messages over this are skipped and counted.")
+        ("drain-timeout", po::value(&options.drain_timeout)->default_value(options.drain_timeout),
+         "Seconds to wait for outstanding pushes at the end of the run");
+
+    po::options_description pusher_opts("Pusher");
+    pusher_opts.add_options()
+        ("jwt-ttl", po::value(&config.google.jwt_ttl_minutes)->default_value(config.google.jwt_ttl_minutes),
+         "JWT token time to live in minutes")
+        ("jwt-refresh", po::value(&config.google.jwt_refresh_minutes)->default_value(config.google.jwt_refresh_minutes),
+         "Minutes before expiry to refresh the OAuth token")
+        ("shards", po::value(&config.google.shards)->default_value(config.google.shards),
+         "Number of pusher shards")
+        ("warmup", po::value(&config.google.warmup_connections)->default_value(config.google.warmup_connections),
+         "Number of connections to open while waiting for the first OAuth token")
+        ("max-concurrency", po::value(&config.concurrency.max_limit)->default_value(config.concurrency.max_limit),
+         "Upper bound for the adaptive concurrency limit");
+
+    po::options_description mock("Mock FCM");
+    mock.add_options()
+        ("token-ttl", po::value(&token_ttl)->default_value(token_ttl),
+         "Lifetime in seconds of the OAuth tokens issued by the mock")
+        ("latency-ms", po::value(&latency_ms)->default_value(latency_ms),
+         "Base latency for each send")
+        ("latency-jitter-ms", po::value(&latency_jitter_ms)->default_value(latency_jitter_ms),
+         "Random extra latency for each send, from 0 to this value")
+        ("throttle-rate", po::value(&mock_options.throttle_rate)->default_value(mock_options.throttle_rate),
+         "Fraction of the sends to answer with 429")
+        ("error-rate", po::value(&mock_options.error_rate)->default_value(mock_options.error_rate),
+         "Fraction of the sends to answer with 503")
+        ("disconnect-rate", po::value(&mock_options.disconnect_rate)->default_value(mock_options.disconnect_rate),
+         "Fraction of the responses after which the mock closes the connection")
+        ("mock-threads", po::value(&mock_options.threads)->default_value(mock_options.threads),
+         "Threads for the mock server");
+
+    po::options_description gate("Release gate");
+    gate.add_options()
+        ("max-failure-rate", po::value(&options.max_failure_rate)->default_value(options.max_failure_rate),
+         "Fail the run if the fraction of failed messages exceeds this")
+        ("max-rss-growth-mb", po::value(&options.max_rss_growth_mb)->default_value(options.max_rss_growth_mb),
+         "Fail the run if the RSS grows more than this many MiB. 0 to disable.");
+
+    po::options_description all_options;
+    all_options.add(general).add(traffic).add(pusher_opts).add(mock).add(gate);
+    po::variables_map vm;
+    try {
+        po::store(po::parse_command_line(argc, argv, all_options), vm);
+        po::notify(vm);
+    } catch (const po::error& e) {
+        cerr << "Error parsing command-line options: " << e.what() << endl;
+        cerr << all_options << endl;
+        return 2;
+    }
+
+    if (vm.count("help")) {
+        cout << filesystem::path(argv[0]).stem().string() << " [options]";
+        cout << all_options << endl;
+        return 0;
+    }
+
+    if (options.rate <= 0.0) {
+        cerr << "The rate must be positive" << endl;
+        return 2;
+    }
+
+    if (auto level = toLogLevel(log_level_console)) {
+        logfault::LogManager::Instance().AddHandler(
+            make_unique<logfault::StreamHandler>(clog, *level));
+    }
+
+    mock_options.token_ttl = chrono::seconds{token_ttl};
+    mock_options.latency = chrono::milliseconds{latency_ms};
+    mock_options.latency_jitter = chrono::milliseconds{latency_jitter_ms};
+
+    const auto work_dir = filesystem::temp_directory_path() / format("cpp-push-loadgen-{}", getpid());
+
+    try {
+        MockFcm mock_fcm{mock_options};
+        mock_fcm.start();
+
+        filesystem::create_directories(work_dir);
+        config.google.config_file = writeServiceAccount(work_dir, mock_fcm.url() + "/token");
+        config.google.fcm_url = mock_fcm.url();
+
+        boost::asio::io_context ctx;
+        auto pusher = createPusherForGoogle(config, ctx);
+        LoadRun run{ctx, *pusher, options, mock_fcm};
+
+        boost::asio::co_spawn(ctx, run.drive(), [](exception_ptr ex) {
+            if (ex) {
+                rethrow_exception(ex);
+            }
+        });
+
+        // Don't hang forever if something in the pusher never completes.
+        // The pusher may legitimately use its whole drain timeout.
+        const auto shutdown_timeout = config.shutdown.drain_timeout + chrono::seconds{5};
+        while(!ctx.stopped()) {
+            ctx.run_for(chrono::milliseconds{200});
+            if (run.done() && steady_clock::now() > run.doneAt() + shutdown_timeout) {
+                run.shutdownTimedOut();
+                break;
+            }
+        }
+
+        const auto rval = run.summary();
+        filesystem::remove_all(work_dir);
+
+        if (!ctx.stopped()) {
+            // Pending coroutines refer to the run and the pusher, and there is
+            // no safe order to destroy them in. Just leave.
+            cout.flush();
+            _Exit(rval);
+        }
+
+        pusher.reset();
+        mock_fcm.stop();
+        return rval;
+    } catch (const exception& e) {
+        LOG_ERROR << "The load generator failed: " << e.what();
+        cerr << "The load generator failed: " << e.what() << endl;
+    }
+
+    filesystem::remove_all(work_dir);
+    return 2;
+}
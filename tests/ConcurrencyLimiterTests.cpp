@@ -0,0 +1,244 @@
+
+#include <deque>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "cpp-push/ConcurrencyLimiter.h"
+
+using namespace std;
+using namespace std::chrono_literals;
+using namespace jgaa::cpp_push;
+
+namespace {
+
+using permit_t = ConcurrencyLimiter::Permit;
+using outcome_t = ConcurrencyLimiter::Outcome;
+
+Config::Concurrency fixedLimit(unsigned limit) {
+    Config::Concurrency config;
+    config.adaptive = false;
+    config.initial_limit = limit;
+    return config;
+}
+
+// Acquire a permit that is available right away
+permit_t acquireNow(ConcurrencyLimiter& limiter) {
+    boost::asio::io_context ctx;
+    optional<permit_t> permit;
+    boost::asio::co_spawn(ctx, [&]() -> boost::asio::awaitable<void> {
+        permit = co_await limiter.acquire();
+    }, boost::asio::detached);
+    ctx.run();
+    EXPECT_TRUE(permit.has_value()) << "acquire() did not complete";
+    return permit ? std::move(*permit) : permit_t{};
+}
+
+} // anon ns
+
+TEST(ConcurrencyLimiter, Classify) {
+    EXPECT_EQ(ConcurrencyLimiter::classify(200), outcome_t::OK);
+    EXPECT_EQ(ConcurrencyLimiter::classify(204), outcome_t::OK);
+    EXPECT_EQ(ConcurrencyLimiter::classify(0), outcome_t::OVERLOAD);
+    EXPECT_EQ(ConcurrencyLimiter::classify(429), outcome_t::OVERLOAD);
+    EXPECT_EQ(ConcurrencyLimiter::classify(500), outcome_t::OVERLOAD);
+    EXPECT_EQ(ConcurrencyLimiter::classify(503), outcome_t::OVERLOAD);
+    EXPECT_EQ(ConcurrencyLimiter::classify(400), outcome_t::FAILED);
+    EXPECT_EQ(ConcurrencyLimiter::classify(404), outcome_t::FAILED);
+}
+
+TEST(ConcurrencyLimiter, InitialLimitIsClamped) {
+    Config::Concurrency config;
+    config.initial_limit = 1000;
+    config.max_limit = 10;
+    EXPECT_EQ(ConcurrencyLimiter{config}.stats().limit, 10u);
+
+    config.initial_limit = 0;
+    config.min_limit = 3;
+    EXPECT_EQ(ConcurrencyLimiter{config}.stats().limit, 3u);
+}
+
+TEST(ConcurrencyLimiter, WaitersAreResumedInOrder) {
+    ConcurrencyLimiter limiter{fixedLimit(1)};
+    boost::asio::io_context ctx;
+
+    auto first = acquireNow(limiter);
+    EXPECT_EQ(limiter.stats().in_flight, 1u);
+
+    vector<int> order;
+    for(auto i = 0; i < 3; ++i) {
+        boost::asio::co_spawn(ctx, [&, i]() -> boost::asio::awaitable<void> {
+            auto permit = co_await limiter.acquire();
+            EXPECT_TRUE(permit);
+            order.push_back(i);
+            permit.done(outcome_t::OK);
+        }, boost::asio::detached);
+    }
+
+    ctx.poll();
+    EXPECT_TRUE(order.empty());
+    EXPECT_EQ(limiter.stats().waiting, 3u);
+
+    first.done(outcome_t::OK);
+    ctx.run();
+
+    EXPECT_EQ(order, (vector<int>{0, 1, 2}));
+    EXPECT_EQ(limiter.stats().in_flight, 0u);
+    EXPECT_EQ(limiter.stats().waiting, 0u);
+    EXPECT_EQ(limiter.stats().num_ok, 4u);
+}
+
+TEST(ConcurrencyLimiter, DestroyedPermitIsReleasedAsFailed) {
+    ConcurrencyLimiter limiter{fixedLimit(2)};
+    {
+        auto permit = acquireNow(limiter);
+        EXPECT_EQ(limiter.stats().in_flight, 1u);
+    }
+    EXPECT_EQ(limiter.stats().in_flight, 0u);
+    EXPECT_EQ(limiter.stats().num_failed, 1u);
+}
+
+TEST(ConcurrencyLimiter, FixedLimitIgnoresOverload) {
+    ConcurrencyLimiter limiter{fixedLimit(8)};
+    for(auto i = 0; i < 10; ++i) {
+        acquireNow(limiter).done(outcome_t::OVERLOAD);
+    }
+    EXPECT_EQ(limiter.stats().limit, 8u);
+    EXPECT_EQ(limiter.stats().num_overload, 10u);
+}
+
+TEST(ConcurrencyLimiter, GrowsWhenTheLimitIsUsed) {
+    Config::Concurrency config;
+    config.initial_limit = 4;
+    config.max_limit = 6;
+    config.latency_tolerance = 1000.0; // Don't let scheduling jitter count as congestion
+    ConcurrencyLimiter limiter{config};
+
+    // Keep the limiter full, completing the oldest request each round
+    deque<permit_t> permits;
+    for(auto i = 0; i < 4; ++i) {
+        permits.push_back(acquireNow(limiter));
+    }
+
+    for(auto i = 0; i < 100; ++i) {
+        this_thread::sleep_for(200us);
+        permits.front().done(outcome_t::OK);
+        permits.pop_front();
+        permits.push_back(acquireNow(limiter));
+    }
+
+    EXPECT_EQ(limiter.stats().limit, 6u);
+}
+
+TEST(ConcurrencyLimiter, DoesNotGrowWhenTheLimitIsNotUsed) {
+    Config::Concurrency config;
+    config.initial_limit = 10;
+    config.latency_tolerance = 1000.0;
+    ConcurrencyLimiter limiter{config};
+
+    for(auto i = 0; i < 100; ++i) {
+        acquireNow(limiter).done(outcome_t::OK);
+    }
+
+    EXPECT_EQ(limiter.stats().limit, 10u);
+}
+
+TEST(ConcurrencyLimiter, BacksOffOncePerRoundTrip) {
+    Config::Concurrency config;
+    config.initial_limit = 10;
+    config.backoff_ratio = 0.5;
+    ConcurrencyLimiter limiter{config};
+
+    // Establish a smoothed RTT of about 50 ms
+    auto permit = acquireNow(limiter);
+    this_thread::sleep_for(50ms);
+    permit.done(outcome_t::OK);
+    EXPECT_EQ(limiter.stats().limit, 10u);
+
+    // Many requests see the same congestion. Only the first one counts.
+    auto a = acquireNow(limiter);
+    auto b = acquireNow(limiter);
+    a.done(outcome_t::OVERLOAD);
+    EXPECT_EQ(limiter.stats().limit, 5u);
+    b.done(outcome_t::OVERLOAD);
+    EXPECT_EQ(limiter.stats().limit, 5u);
+
+    // After one more round-trip, we back off again
+    this_thread::sleep_for(60ms);
+    acquireNow(limiter).done(outcome_t::OVERLOAD);
+    EXPECT_EQ(limiter.stats().limit, 2u);
+}
+
+TEST(ConcurrencyLimiter, DoesNotBackOffBelowMinLimit) {
+    Config::Concurrency config;
+    config.initial_limit = 10;
+    config.min_limit = 4;
+    config.backoff_ratio = 0.5;
+    ConcurrencyLimiter limiter{config};
+
+    // Without a RTT estimate, every overload backs off
+    for(auto i = 0; i < 10; ++i) {
+        acquireNow(limiter).done(outcome_t::OVERLOAD);
+    }
+
+    EXPECT_EQ(limiter.stats().limit, 4u);
+}
+
+TEST(ConcurrencyLimiter, BacksOffWhenLatencyRises) {
+    Config::Concurrency config;
+    config.initial_limit = 10;
+    config.backoff_ratio = 0.5;
+    config.latency_tolerance = 2.0;
+    ConcurrencyLimiter limiter{config};
+
+    auto fast = acquireNow(limiter);
+    this_thread::sleep_for(1ms);
+    fast.done(outcome_t::OK);
+    EXPECT_EQ(limiter.stats().limit, 10u);
+
+    auto slow = acquireNow(limiter);
+    this_thread::sleep_for(50ms);
+    slow.done(outcome_t::OK);
+    EXPECT_EQ(limiter.stats().limit, 5u);
+}
+
+TEST(ConcurrencyLimiter, CloseResumesWaitersWithEmptyPermits) {
+    ConcurrencyLimiter limiter{fixedLimit(1)};
+    boost::asio::io_context ctx;
+
+    auto held = acquireNow(limiter);
+
+    auto granted = 0, empty = 0;
+    for(auto i = 0; i < 3; ++i) {
+        boost::asio::co_spawn(ctx, [&]() -> boost::asio::awaitable<void> {
+            auto permit = co_await limiter.acquire();
+            ++(permit ? granted : empty);
+        }, boost::asio::detached);
+    }
+
+    ctx.poll();
+    EXPECT_EQ(limiter.stats().waiting, 3u);
+
+    limiter.close();
+    ctx.run();
+
+    EXPECT_EQ(granted, 0);
+    EXPECT_EQ(empty, 3);
+    EXPECT_EQ(limiter.stats().waiting, 0u);
+
+    // Permits handed out before close() are not affected
+    EXPECT_TRUE(held);
+    EXPECT_EQ(limiter.stats().in_flight, 1u);
+    held.done(outcome_t::OK);
+    EXPECT_EQ(limiter.stats().in_flight, 0u);
+}
+
+TEST(ConcurrencyLimiter, AcquireAfterCloseReturnsEmptyPermit) {
+    ConcurrencyLimiter limiter{fixedLimit(4)};
+    limiter.close();
+
+    auto permit = acquireNow(limiter);
+    EXPECT_FALSE(permit);
+    EXPECT_EQ(limiter.stats().in_flight, 0u);
+}
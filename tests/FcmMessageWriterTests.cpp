@@ -0,0 +1,476 @@
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include <boost/json.hpp>
+
+#include "FcmMessageWriter.h"
+
+using namespace std;
+using namespace jgaa::cpp_push;
+
+namespace {
+
+using message_t = GooglePusher::GooglePushMessage;
+
+// The request body as gpush() built it before FcmMessageWriter
+string referenceBody(const message_t& pm, string_view token) {
+    boost::json::object message;
+    if (!pm.data.empty()) {
+        boost::json::object data;
+        for (auto& kv : pm.data)
+            data[std::string(kv.first)] = std::string(kv.second);
+        message["data"] = data;
+    }
+
+    boost::json::object android;
+    android["ttl"] = format("{}s", pm.ttl_minutes * 60);
+    android["priority"] = (pm.priority == GooglePusher::AndroidPriority::High ? "HIGH" : "NORMAL");
+
+    if (pm.notification) {
+        boost::json::object notif;
+        if (!pm.notification->title.empty()) {
+            notif["title"] = pm.notification->title;
+        }
+        if (!pm.notification->body.empty()) {
+            notif["body"] = pm.notification->body;
+        }
+        if (!pm.notification->sound.empty()) {
+            notif["sound"] = pm.notification->sound;
+        }
+        if (!pm.notification->click_action.empty()) {
+            notif["click_action"] = pm.notification->click_action;
+        }
+        if (!pm.notification->tag.empty()) {
+            notif["tag"] = pm.notification->tag;
+        }
+        if (!pm.notification->color.empty()) {
+            notif["color"] = pm.notification->color;
+        }
+        if (!pm.notification->image_url.empty()) {
+            notif["image"] = pm.notification->image_url;
+        }
+        if (!pm.notification->icon.empty()) {
+            notif["icon"] = pm.notification->icon;
+        }
+
+        message["notification"] = notif;
+    }
+
+    message["android"] = android;
+    boost::json::object root;
+    message["token"] = token;
+    root["message"] = message;
+    if (pm.dry_run) {
+        root["dry_run"] = true;
+    }
+    return boost::json::serialize(root);
+}
+
+string writerBody(const message_t& pm, string_view token) {
+    FcmMessageWriter writer;
+    writer.prepare(pm);
+    string out;
+    writer.write(out, token);
+    return out;
+}
+
+string referenceEscaped(string_view value) {
+    const auto quoted = boost::json::serialize(boost::json::value(value));
+    return quoted.substr(1, quoted.size() - 2);
+}
+
+// Random text with control characters, characters that must be escaped,
+// plain ASCII and valid UTF-8 sequences, of exactly `size` bytes.
+string randomText(mt19937& rng, size_t size) {
+    static const vector<string> pieces{
+        "a", "Z", "0", " ", "/", "{", "}", ":", ",", "\x7f",
+        "\"", "\\", "\n", "\r", "\t", "\b", "\f",
+        "\xc3\xa6", "\xe2\x82\xac", "\xf0\x9f\x98\x80" // æ, €, 😀
+    };
+
+    string text;
+    while(text.size() < size) {
+        if (rng() % 4 == 0) {
+            text += static_cast<char>(rng() % 0x20); // Any control character, including NUL
+            continue;
+        }
+        const auto& piece = pieces[rng() % pieces.size()];
+        if (text.size() + piece.size() <= size) {
+            text += piece;
+        }
+    }
+    return text;
+}
+
+Config::Google compaction(size_t max_payload_bytes, bool drop_optional_fields, bool truncate_body) {
+    Config::Google config;
+    config.max_payload_bytes = max_payload_bytes;
+    config.compaction.drop_optional_fields = drop_optional_fields;
+    config.compaction.truncate_body = truncate_body;
+    return config;
+}
+
+size_t payloadSize(const message_t& pm) {
+    FcmMessageWriter writer;
+    writer.prepare(pm);
+    return writer.payloadSize();
+}
+
+constexpr string_view ellipsis = "\xe2\x80\xa6";
+
+// Lengths on both sides of the 16 byte SIMD blocks
+const vector<size_t> interesting_sizes{0, 1, 2, 15, 16, 17, 31, 32, 33, 47, 48, 49, 64, 100, 257};
+
+} // anon ns
+
+TEST(FcmMessageWriter, EscapesLikeBoostJson) {
+    mt19937 rng{42};
+    for(const auto size : interesting_sizes) {
+        for(auto i = 0; i < 200; ++i) {
+            const auto text = randomText(rng, size);
+            string out;
+            FcmMessageWriter::appendEscaped(out, text);
+            EXPECT_EQ(out, referenceEscaped(text)) << "size=" << size;
+            EXPECT_EQ(FcmMessageWriter::escapedSize(text), out.size());
+        }
+    }
+}
+
+TEST(FcmMessageWriter, EscapesEveryControlCharacter) {
+    for(auto ch = 0; ch < 0x20; ++ch) {
+        // Put the character at every position in a 33 byte string
+        for(size_t pos = 0; pos < 33; ++pos) {
+            string text(33, 'x');
+            text[pos] = static_cast<char>(ch);
+            string out;
+            FcmMessageWriter::appendEscaped(out, text);
+            EXPECT_EQ(out, referenceEscaped(text)) << "ch=" << ch << " pos=" << pos;
+        }
+    }
+}
+
+TEST(FcmMessageWriter, AppendsToExistingContent) {
+    string out = "prefix";
+    FcmMessageWriter::appendEscaped(out, "\"quoted\"");
+    EXPECT_EQ(out, R"(prefix\"quoted\")");
+}
+
+TEST(FcmMessageWriter, MinimalMessage) {
+    message_t pm;
+    EXPECT_EQ(writerBody(pm, "token"), referenceBody(pm, "token"));
+}
+
+TEST(FcmMessageWriter, FullMessage) {
+    vector<pair<string_view, string_view>> data{{"key", "value"}, {"other", "with \"quotes\"\n"}};
+    GooglePusher::GoogleNotification n;
+    n.title = "Title";
+    n.body = "Body\twith tab";
+    n.sound = "default";
+    n.click_action = "OPEN";
+    n.tag = "tag";
+    n.color = "#ff0000";
+    n.image_url = "https://example.com/image.png";
+    n.icon = "icon";
+
+    message_t pm;
+    pm.data = data;
+    pm.notification = n;
+    pm.priority = GooglePusher::AndroidPriority::High;
+    pm.ttl_minutes = 7;
+    pm.dry_run = true;
+
+    EXPECT_EQ(writerBody(pm, "tok\"en"), referenceBody(pm, "tok\"en"));
+}
+
+TEST(FcmMessageWriter, EmptyNotificationFieldsAreLeftOut) {
+    GooglePusher::GoogleNotification n;
+    n.body = "Only the body";
+
+    message_t pm;
+    pm.notification = n;
+    EXPECT_EQ(writerBody(pm, "token"), referenceBody(pm, "token"));
+
+    pm.notification = GooglePusher::GoogleNotification{};
+    EXPECT_EQ(writerBody(pm, "token"), referenceBody(pm, "token"));
+}
+
+TEST(FcmMessageWriter, DuplicateDataKeysKeepBoostOrder) {
+    // boost::json::object keeps the position of the first key, and the last value
+    vector<pair<string_view, string_view>> data{
+        {"a", "1"}, {"b", "2"}, {"a", "3"}, {"c", "4"}, {"b", "5"}, {"a", "6"}};
+
+    message_t pm;
+    pm.data = data;
+    const auto body = writerBody(pm, "token");
+    EXPECT_EQ(body, referenceBody(pm, "token"));
+    EXPECT_NE(body.find(R"("data":{"a":"6","b":"5","c":"4"})"), string::npos) << body;
+}
+
+TEST(FcmMessageWriter, RandomMessages) {
+    mt19937 rng{4711};
+    for(auto i = 0; i < 500; ++i) {
+        const auto size = interesting_sizes[rng() % interesting_sizes.size()];
+
+        vector<string> strings;
+        for(auto j = 0; j < 8; ++j) {
+            strings.push_back(randomText(rng, size));
+        }
+
+        vector<pair<string_view, string_view>> data{
+            {strings[0], strings[1]}, {strings[2], strings[3]}, {strings[0], strings[4]}};
+
+        GooglePusher::GoogleNotification n;
+        n.title = strings[5];
+        n.body = strings[6];
+
+        message_t pm;
+        pm.data = data;
+        if (rng() % 2) {
+            pm.notification = n;
+        }
+        pm.ttl_minutes = static_cast<uint32_t>(rng() % 100000);
+        pm.dry_run = rng() % 2;
+
+        EXPECT_EQ(writerBody(pm, strings[7]), referenceBody(pm, strings[7])) << "i=" << i;
+    }
+}
+
+TEST(FcmMessageWriter, PayloadSizeCountsDataAndNotification) {
+    vector<pair<string_view, string_view>> data{{"k", "v"}};
+    GooglePusher::GoogleNotification n;
+    n.title = "T";
+
+    message_t pm;
+    pm.data = data;
+    pm.notification = n;
+
+    FcmMessageWriter writer;
+    writer.prepare(pm);
+    EXPECT_EQ(writer.payloadSize(), string_view{R"("data":{"k":"v"})"}.size()
+                                    + string_view{R"("notification":{"title":"T"})"}.size());
+}
+
+TEST(FcmMessageWriter, BufferCanBeReused) {
+    message_t pm;
+    FcmMessageWriter writer;
+    writer.prepare(pm);
+
+    string out;
+    writer.write(out, "first");
+    out.clear();
+    writer.write(out, "second");
+    EXPECT_EQ(out, referenceBody(pm, "second"));
+}
+
+TEST(FcmMessageWriter, TruncateEscaped) {
+    EXPECT_EQ(FcmMessageWriter::truncateEscaped("hello", 0), "");
+    EXPECT_EQ(FcmMessageWriter::truncateEscaped("hello", 3), "hel");
+    EXPECT_EQ(FcmMessageWriter::truncateEscaped("hello", 5), "hello");
+    EXPECT_EQ(FcmMessageWriter::truncateEscaped("hello", 100), "hello");
+    EXPECT_EQ(FcmMessageWriter::truncateEscaped("", 10), "");
+}
+
+TEST(FcmMessageWriter, TruncateEscapedKeepsUtf8Sequences) {
+    const string_view text = "a\xc3\xa6\xe2\x82\xac\xf0\x9f\x98\x80"; // a, æ, €, 😀
+
+    EXPECT_EQ(FcmMessageWriter::truncateEscaped(text, 1), "a");
+    EXPECT_EQ(FcmMessageWriter::truncateEscaped(text, 2), "a");
+    EXPECT_EQ(FcmMessageWriter::truncateEscaped(text, 3), "a\xc3\xa6");
+    EXPECT_EQ(FcmMessageWriter::truncateEscaped(text, 5), "a\xc3\xa6");
+    EXPECT_EQ(FcmMessageWriter::truncateEscaped(text, 6), "a\xc3\xa6\xe2\x82\xac");
+    EXPECT_EQ(FcmMessageWriter::truncateEscaped(text, 9), "a\xc3\xa6\xe2\x82\xac");
+    EXPECT_EQ(FcmMessageWriter::truncateEscaped(text, 10), text);
+}
+
+TEST(FcmMessageWriter, TruncateEscapedCountsEscapes) {
+    EXPECT_EQ(FcmMessageWriter::truncateEscaped("\"\"\"", 3), "\"");
+    EXPECT_EQ(FcmMessageWriter::truncateEscaped("\"\"\"", 4), "\"\"");
+    EXPECT_EQ(FcmMessageWriter::truncateEscaped("a\\b", 2), "a");
+    EXPECT_EQ(FcmMessageWriter::truncateEscaped("a\\b", 3), "a\\");
+    EXPECT_EQ(FcmMessageWriter::truncateEscaped("\x01\x01", 11), "\x01"); // \u0001
+    EXPECT_EQ(FcmMessageWriter::truncateEscaped("\x01\x01", 12), "\x01\x01");
+}
+
+TEST(FcmMessageWriter, TruncateEscapedRandomText) {
+    mt19937 rng{17};
+    for(auto i = 0; i < 1000; ++i) {
+        const auto text = randomText(rng, interesting_sizes[rng() % interesting_sizes.size()]);
+        const auto max_size = rng() % (FcmMessageWriter::escapedSize(text) + 2);
+        const auto prefix = FcmMessageWriter::truncateEscaped(text, max_size);
+
+        ASSERT_EQ(prefix, string_view{text}.substr(0, prefix.size()));
+        EXPECT_LE(FcmMessageWriter::escapedSize(prefix), max_size);
+        if (prefix.size() < text.size()) {
+            EXPECT_NE(static_cast<unsigned char>(text[prefix.size()]) & 0xc0, 0x80) << "Split UTF-8 sequence";
+        }
+    }
+}
+
+TEST(FcmMessageWriter, CompactionNeedsANotification) {
+    const string value(100, 'x');
+    vector<pair<string_view, string_view>> data{{"key", value}};
+    message_t pm;
+    pm.data = data;
+
+    FcmMessageWriter writer;
+    message_t compacted;
+    string body_buffer;
+    EXPECT_FALSE(writer.prepareCompacted(compaction(50, true, true), pm, compacted, body_buffer));
+}
+
+TEST(FcmMessageWriter, CompactionDisabled) {
+    const string body(100, 'x');
+    GooglePusher::GoogleNotification n;
+    n.body = body;
+    message_t pm;
+    pm.notification = n;
+
+    FcmMessageWriter writer;
+    message_t compacted;
+    string body_buffer;
+    EXPECT_FALSE(writer.prepareCompacted(compaction(50, false, false), pm, compacted, body_buffer));
+}
+
+TEST(FcmMessageWriter, CompactionDropsOptionalFields) {
+    const string image(200, 'i');
+    GooglePusher::GoogleNotification n;
+    n.title = "Title";
+    n.body = "Body";
+    n.sound = "default";
+    n.image_url = image;
+    message_t pm;
+    pm.notification = n;
+
+    const auto max_size = payloadSize(pm) - 100;
+    FcmMessageWriter writer;
+    message_t compacted;
+    string body_buffer;
+    ASSERT_TRUE(writer.prepareCompacted(compaction(max_size, true, true), pm, compacted, body_buffer));
+
+    EXPECT_LE(writer.payloadSize(), max_size);
+    EXPECT_EQ(compacted.notification->title, "Title");
+    EXPECT_EQ(compacted.notification->body, "Body"); // Not truncated when dropping the fields is enough
+    EXPECT_TRUE(compacted.notification->image_url.empty());
+    EXPECT_TRUE(compacted.notification->sound.empty());
+
+    string out;
+    writer.write(out, "token");
+    EXPECT_EQ(out, referenceBody(compacted, "token"));
+}
+
+TEST(FcmMessageWriter, CompactionDropsFieldsButIsStillTooLarge) {
+    const string body(200, 'b');
+    GooglePusher::GoogleNotification n;
+    n.body = body;
+    n.icon = "icon";
+    message_t pm;
+    pm.notification = n;
+
+    const auto max_size = payloadSize(pm) - 100;
+    FcmMessageWriter writer;
+    message_t compacted;
+    string body_buffer;
+    EXPECT_FALSE(writer.prepareCompacted(compaction(max_size, true, false), pm, compacted, body_buffer));
+    EXPECT_GT(writer.payloadSize(), max_size);
+}
+
+TEST(FcmMessageWriter, CompactionTruncatesTheBodyToTheLimit) {
+    const string body(200, 'b');
+    GooglePusher::GoogleNotification n;
+    n.body = body;
+    message_t pm;
+    pm.notification = n;
+
+    for(const size_t over : {1, 2, 3, 50, 196}) {
+        const auto max_size = payloadSize(pm) - over;
+        FcmMessageWriter writer;
+        message_t compacted;
+        string body_buffer;
+        ASSERT_TRUE(writer.prepareCompacted(compaction(max_size, false, true), pm, compacted, body_buffer));
+
+        // Plain ASCII is truncated to exactly the limit, with room for the ellipsis
+        EXPECT_EQ(writer.payloadSize(), max_size) << "over=" << over;
+        const auto& truncated = compacted.notification->body;
+        EXPECT_EQ(truncated.data(), body_buffer.data());
+        EXPECT_EQ(truncated.size(), body.size() - over);
+        EXPECT_TRUE(truncated.ends_with(ellipsis));
+    }
+}
+
+TEST(FcmMessageWriter, CompactionDropsABodyThatCannotHoldTheEllipsis) {
+    const string title(100, 't');
+    GooglePusher::GoogleNotification n;
+    n.title = title;
+    n.body = "abc";
+    message_t pm;
+    pm.notification = n;
+
+    // Removing the body is enough, but there is no room for a truncated body
+    const auto max_size = payloadSize(pm) - 3;
+    FcmMessageWriter writer;
+    message_t compacted;
+    string body_buffer;
+    ASSERT_TRUE(writer.prepareCompacted(compaction(max_size, false, true), pm, compacted, body_buffer));
+    EXPECT_TRUE(compacted.notification->body.empty());
+    EXPECT_LE(writer.payloadSize(), max_size);
+
+    // Too large even without the body
+    EXPECT_FALSE(writer.prepareCompacted(compaction(50, false, true), pm, compacted, body_buffer));
+}
+
+TEST(FcmMessageWriter, CompactionTruncatesBodiesFullOfEscapes) {
+    const string body(100, '"'); // Each character is two bytes when escaped
+    GooglePusher::GoogleNotification n;
+    n.body = body;
+    message_t pm;
+    pm.notification = n;
+
+    for(size_t over = 1; over < 40; ++over) {
+        const auto max_size = payloadSize(pm) - over;
+        FcmMessageWriter writer;
+        message_t compacted;
+        string body_buffer;
+        ASSERT_TRUE(writer.prepareCompacted(compaction(max_size, false, true), pm, compacted, body_buffer));
+
+        EXPECT_LE(writer.payloadSize(), max_size) << "over=" << over;
+        EXPECT_GE(writer.payloadSize() + 1, max_size) << "over=" << over;
+
+        auto truncated = compacted.notification->body;
+        ASSERT_TRUE(truncated.ends_with(ellipsis));
+        truncated.remove_suffix(ellipsis.size());
+        EXPECT_EQ(truncated.find_first_not_of('"'), string_view::npos);
+
+        string out;
+        writer.write(out, "token");
+        EXPECT_EQ(out, referenceBody(compacted, "token"));
+    }
+}
+
+TEST(FcmMessageWriter, CompactionTruncatesMultibyteBodies) {
+    string body;
+    for(auto i = 0; i < 50; ++i) {
+        body += "\xe2\x82\xac"; // €
+    }
+    GooglePusher::GoogleNotification n;
+    n.body = body;
+    message_t pm;
+    pm.notification = n;
+
+    for(size_t over = 1; over < 10; ++over) {
+        const auto max_size = payloadSize(pm) - over;
+        FcmMessageWriter writer;
+        message_t compacted;
+        string body_buffer;
+        ASSERT_TRUE(writer.prepareCompacted(compaction(max_size, false, true), pm, compacted, body_buffer));
+
+        EXPECT_LE(writer.payloadSize(), max_size) << "over=" << over;
+        const auto& truncated = compacted.notification->body;
+        ASSERT_TRUE(truncated.ends_with(ellipsis));
+        // Only whole characters, plus the ellipsis
+        EXPECT_EQ(truncated.size() % 3, 0u) << "over=" << over;
+        EXPECT_EQ(body.substr(0, truncated.size() - ellipsis.size()), truncated.substr(0, truncated.size() - ellipsis.size()));
+    }
+}
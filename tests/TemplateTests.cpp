@@ -0,0 +1,151 @@
+
+#include <stdexcept>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "cpp-push/Template.h"
+#include "FcmMessageWriter.h"
+
+using namespace std;
+using namespace jgaa::cpp_push;
+
+namespace {
+
+using vars_t = vector<pair<string_view, string_view>>;
+
+string json(const Template& tpl, const vars_t& vars) {
+    string out;
+    tpl.appendJson(out, vars);
+    return out;
+}
+
+} // anon ns
+
+TEST(Template, PlainText) {
+    const Template tpl{"Hello world"};
+    EXPECT_TRUE(tpl.isConstant());
+    EXPECT_EQ(tpl.render({}), "Hello world");
+}
+
+TEST(Template, EmptyText) {
+    const Template tpl{""};
+    EXPECT_TRUE(tpl.isConstant());
+    EXPECT_EQ(tpl.render({}), "");
+}
+
+TEST(Template, Placeholders) {
+    const Template tpl{"Hi {name}, you have {count} new messages"};
+    EXPECT_FALSE(tpl.isConstant());
+
+    const vars_t vars{{"count", "3"}, {"name", "Ola"}};
+    EXPECT_EQ(tpl.render(vars), "Hi Ola, you have 3 new messages");
+}
+
+TEST(Template, PlaceholdersOnly) {
+    const Template tpl{"{a}{b}{a}"};
+    const vars_t vars{{"a", "1"}, {"b", "2"}};
+    EXPECT_EQ(tpl.render(vars), "121");
+}
+
+TEST(Template, MissingVariableIsEmpty) {
+    const Template tpl{"[{missing}]"};
+    EXPECT_EQ(tpl.render({}), "[]");
+}
+
+TEST(Template, EscapedBraces) {
+    const Template tpl{"{{literal}} {{{name}}} }}{{"};
+    EXPECT_TRUE(Template{"{{}}"}.isConstant());
+
+    const vars_t vars{{"name", "x"}};
+    EXPECT_EQ(tpl.render(vars), "{literal} {x} }{");
+}
+
+TEST(Template, SyntaxErrors) {
+    EXPECT_THROW(Template{"{"}, invalid_argument);
+    EXPECT_THROW(Template{"Hi {name"}, invalid_argument);
+    EXPECT_THROW(Template{"}"}, invalid_argument);
+    EXPECT_THROW(Template{"Hi name}"}, invalid_argument);
+    EXPECT_THROW(Template{"{}"}, invalid_argument);
+    EXPECT_THROW(Template{"{a{b}"}, invalid_argument);
+    EXPECT_THROW(Template{"{{x}"}, invalid_argument); // `{{` is a literal brace, then `x}` is unmatched
+}
+
+TEST(Template, JsonEscapesLiteralsAndValues) {
+    const Template tpl{"\"{name}\"\n"};
+    const vars_t vars{{"name", "a\\b\"c\td"}};
+
+    const auto rendered = tpl.render(vars);
+    string expected;
+    FcmMessageWriter::appendEscaped(expected, rendered);
+
+    EXPECT_EQ(json(tpl, vars), expected);
+    EXPECT_EQ(json(tpl, vars), R"(\"a\\b\"c\td\"\n)");
+}
+
+TEST(Template, JsonAppends) {
+    const Template tpl{"{v}"};
+    const vars_t vars{{"v", "x"}};
+    string out = "prefix:";
+    tpl.appendJson(out, vars);
+    EXPECT_EQ(out, "prefix:x");
+}
+
+TEST(Template, CopiesAreIndependent) {
+    auto original = make_unique<Template>("Short {v}");
+    const Template copy = *original;
+    original.reset();
+
+    const vars_t vars{{"v", "text"}};
+    EXPECT_EQ(copy.render(vars), "Short text");
+    EXPECT_EQ(json(copy, vars), "Short text");
+}
+
+TEST(TemplateCatalog, LocaleFallback) {
+    TemplateCatalog catalog{"en"};
+    catalog.add("welcome", "en", "Welcome", "");
+    catalog.add("welcome", "nb", "Velkommen", "");
+    catalog.add("welcome", "nb-NO", "Velkommen til Norge", "");
+
+    auto title = [&](string_view locale) {
+        const auto *nt = catalog.find("welcome", locale);
+        return nt && nt->title ? nt->title->render({}) : string{"<none>"};
+    };
+
+    EXPECT_EQ(title("nb-NO"), "Velkommen til Norge");
+    EXPECT_EQ(title("nb_SE"), "Velkommen");
+    EXPECT_EQ(title("nb"), "Velkommen");
+    EXPECT_EQ(title("de-DE"), "Welcome");
+    EXPECT_EQ(title(""), "Welcome");
+    EXPECT_EQ(catalog.find("unknown", "en"), nullptr);
+}
+
+TEST(TemplateCatalog, NoDefaultLocale) {
+    TemplateCatalog catalog{"en"};
+    catalog.add("only", "fr", "Bonjour", "");
+    EXPECT_NE(catalog.find("only", "fr-CA"), nullptr);
+    EXPECT_EQ(catalog.find("only", "de"), nullptr);
+}
+
+TEST(TemplateCatalog, EmptyTextMeansNoField) {
+    TemplateCatalog catalog;
+    catalog.add("t", "en", "", "Body only");
+    const auto *nt = catalog.find("t", "en");
+    ASSERT_NE(nt, nullptr);
+    EXPECT_FALSE(nt->title);
+    ASSERT_TRUE(nt->body);
+    EXPECT_EQ(nt->body->render({}), "Body only");
+}
+
+TEST(TemplateCatalog, AddReplaces) {
+    TemplateCatalog catalog;
+    catalog.add("t", "en", "First", "");
+    catalog.add("t", "en", "Second", "");
+    EXPECT_EQ(catalog.find("t", "en")->title->render({}), "Second");
+}
+
+TEST(TemplateCatalog, InvalidTemplateThrows) {
+    TemplateCatalog catalog;
+    EXPECT_THROW(catalog.add("t", "en", "Hi {name", ""), invalid_argument);
+    EXPECT_EQ(catalog.find("t", "en"), nullptr);
+}